@@ -2,54 +2,523 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define ED_SIMD_X86
+#endif
 
 enum EditorMode { NORMAL_MODE = 0, INSERT_MODE };
 
+// row ops written to the journal
+enum JournalOp {
+  JR_INSERT = 1,   // insert len bytes at pos, the bytes follow the record
+  JR_DELETE,       // delete len bytes at pos
+  JR_INSERT_ROWS,  // insert pos empty rows at row
+  JR_DELETE_ROW    // delete len rows at row, one if len is 0
+};
+
+// nodes of a parsed regex
+enum RxNode {
+  RX_SET = 0,  // a byte in a set
+  RX_EMPTY,
+  RX_CAT,
+  RX_ALT,    // \|
+  RX_STAR,   // *
+  RX_PLUS,   // \+
+  RX_QUEST,  // \= or \?
+  RX_BOL,    // ^
+  RX_EOL,    // $
+  RX_BOW,    // \<
+  RX_EOW     // \>
+};
+
+// nfa instructions
+enum NfaOp {
+  NFA_SET = 0,  // consume a byte in set x
+  NFA_SPLIT,    // go on with both x and y
+  NFA_JMP,      // go on with x
+  NFA_BOL,      // the byte before is a line end or there is none
+  NFA_EOL,      // the byte after is a line end or there is none
+  NFA_BOW,      // between a non word byte and a word byte
+  NFA_EOW,      // between a word byte and a non word byte
+  NFA_MATCH
+};
+
+// kinds of bytes the assertions look at
+enum RxKind { RX_KIND_EOL = 0, RX_KIND_WORD, RX_KIND_OTHER };
+
+// highlight classes of rendered bytes
+enum Highlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,  // types
+  HL_STRING,
+  HL_NUMBER,
+  HL_PREPROC
+};
+
+// what the lexer is in the middle of at the end of a row
+enum LexState { LEX_CODE = 0, LEX_COMMENT, LEX_STRING, LEX_CHAR };
+
 struct motion {
-  int n;  // default is 1, means do motion once. But for some motion(gg) is 0
+  int n;  // count typed before the motion, 0 if none: j moves once and G
+          // goes to the last row
   char motion[3];  // examples: h,j,k,l,G,gg,x,dd,yy
 };
 
 struct op_motion {
   char op;          // support operators: c,d,y;
-  struct motion m;  // support motion: w, e, $, 0
+  struct motion m;  // any motion, or the operator again for whole rows
+};
+
+// memory holding strings of a store
+struct store_block {
+  char *p;
+  int cap;  // from the arena, 0 if from malloc
+};
+
+// strings shared by the registers and the rows, instead of copied. a row
+// viewing one has cap 0 like a row pointing into the map, so it gets a
+// copy of its own before it is changed. the store lives until no row or
+// register view points into it anymore, it is counted as a whole, so a
+// single row left unchanged keeps all strings of the yank alive
+struct store {
+  long refs;
+  struct store_block *blocks;
+  int nblocks;
+  int cap;
+  char used;
+};
+
+// rows of a register, the string of a row when it was yanked. rows
+// still pointing into the map one after another are viewed as one span
+// of the map, split again into rows when they are put
+struct reg_view {
+  char *string;
+  int size;
+  int lines;             // rows in string, 1 unless a span of the map
+  unsigned short store;  // the store string is in, 0 if in the map
+};
+
+#define REGISTERS 27  // the unnamed one, then a to z
+
+// rows yanked or deleted, put back by p and P
+struct reg {
+  int refs;  // registers holding it, both "a and the unnamed one after "ayy
+  struct reg_view *views;
+  int nviews;
+  int lines;
+  char linewise;  // whole rows, else the text from inside the first row
+                  // to inside the last one
 };
 
 struct text_row {
   int size;
   int rsize;  // render size
+  int cap;    // bytes allocated for string, 0 if string points into the map
+  int rcap;   // bytes allocated for render, 0 if render is string
+  int hlcap;  // bytes allocated for hl
+  // lexer states the row was lexed from and ends in, hl_open is
+  // LEX_STALE if it was never lexed or changed since
+  unsigned char hl_open;
+  unsigned char hl_close;
+  unsigned short store;  // the store string is shared in, 0 if none
   char *string;
-  char *render;  // render tab as multiple spaces
+  char *render;       // render tab as multiple spaces, NULL until shown
+  unsigned char *hl;  // enum Highlight of every render byte, NULL until shown
+};
+
+// splits the map into rows on a background thread, the main thread
+// publishes them into editor.row from time to time
+struct row_loader {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  // signaled when rows are split or loading ends
+  TextRow *rows;        // split but not yet published
+  int nrows;
+  int cap;
+  size_t read;  // bytes of map split so far
+  char done;
+  char stop;  // set by the main thread to give up loading
+  char cr;    // a line ended with \r\n
+};
+
+// a save running in a forked child, which writes the rows as they were
+// when it was started
+struct saver {
+  pid_t pid;  // 0 if no save is running
+  int fd;     // reports from the child, -1 if no save is running
+  char done;  // the last report came
+  char again;  // saved meanwhile, save again when it is done
+  int from;    // first row written by the running save, 0 for all of them
+
+  // -i, write the file in place from the first row changed since it was
+  // read or written instead of writing all of it again. only while the
+  // file is as it was then, and never for files with \r\n line ends
+  char incremental;
+  struct stat st;  // the file as it was last read or written
+  char st_valid;
+  char map_is_file;  // the map shows the file, not an unlinked old one
+};
+
+// sent by the saving child as it goes and once it is done
+struct save_report {
+  int percent;
+  int rows;  // rows written so far
+  size_t bytes;
+  int err;  // errno if the save failed
+  char done;
+};
+
+// the start of a journal, the file as it was when the journal was begun.
+// -r only replays the journal on that file
+struct journal_head {
+  char magic[8];  // JOURNAL_MAGIC
+  long long ino;
+  long long size;
+  long long mtime_sec;
+  long long mtime_nsec;
+};
+
+// a journal record, as written to the file
+struct journal_op {
+  int op;
+  int row;
+  int pos;
+  int len;
+};
+
+// edits not saved yet, appended to a journal next to the file as they are
+// made, so they can be replayed on top of the file with -r after a crash
+struct journal {
+  char *path;
+  int fd;           // -1 until the first edit
+  struct abuf buf;  // records not written yet
+  size_t written;   // bytes in the journal
+  size_t save_pos;  // bytes in the journal when the running save started
+  long write_time;  // ms when the journal was last written
+  char unsynced;    // written but not fsynced yet
+  char off;         // not journaling this file
+  char replaying;
+  char recover;  // -r
+};
+
+// an edit kept for undo, op is one of enum JournalOp and the other fields
+// are as journaled. for JR_INSERT_ROWS and JR_DELETE_ROW len is the
+// number of rows
+struct undo_op {
+  int op;
+  int row;
+  int pos;
+  int len;
+  char *text;     // the bytes inserted or deleted, malloc(3)ed
+  TextRow *rows;  // the rows while they are out of the file, else NULL.
+                  // they are moved here, rows in the map stay there
+  int cap;        // bytes allocated for text, or slots for rows
+  size_t bytes;   // memory held by the op
+};
+
+// the edits undone by one u: those of a normal mode command, or of all
+// that is typed until insert mode is left
+struct undo_change {
+  struct undo_op *ops;
+  int nops;
+  int cap;
+  int cy;   // cursor before the change
+  int pos;  // byte in row cy
+};
+
+// changes made to the file, oldest first. the undone ones stay after
+// done to be redone, until the next edit drops them
+struct undo {
+  struct undo_change *changes;
+  int nchanges;
+  int cap;
+  int done;      // changes not undone
+  size_t bytes;  // memory held by the changes
+  size_t limit;  // the oldest changes are dropped above it, -u
+  char seal;     // the next edit starts a new change
+  char applying;  // undoing or redoing, the edits are not recorded
+};
+
+// a language highlighted by the lexer, picked by the file name
+struct syntax {
+  const char *name;
+  const char **exts;      // file name endings
+  const char **keywords;  // types end with '|'
+};
+
+// a row being lexed, hl gets the class of every render byte if it is set
+struct lexer {
+  const char *s;
+  int len;
+  int i;  // next byte
+  unsigned char *hl;
+  int rx;  // render index of s[i]
+};
+
+// a node of a parsed regex, a and b index its operands
+struct rx_node {
+  int type;  // enum RxNode
+  int set;   // RX_SET: index of its byte set
+  int a;
+  int b;
+};
+
+struct nfa_inst {
+  int op;  // enum NfaOp
+  int x;
+  int y;
+};
+
+// a compiled pattern, searched for with ed_find() if it is a fixed
+// string. otherwise it is compiled to an nfa twice: to match text from
+// left to right and from right to left
+struct regex {
+  char *literal;  // the pattern without escapes if it is a fixed string
+  int literal_len;
+  unsigned char (*sets)[32];  // bitmaps of the bytes NFA_SET consume
+  int nsets;
+  struct nfa_inst *fwd;
+  struct nfa_inst *rev;
+  int len;  // instructions in each of them
+};
+
+// a pattern being parsed and compiled
+struct rx_compiler {
+  const char *p;  // next byte of the pattern
+  const char *end;
+  const char *err;
+  struct rx_node *nodes;
+  int nnodes;
+  int nodecap;
+  struct regex *re;
+  int setcap;
+  struct nfa_inst *code;  // the nfa being emitted
+  int len;
+  int cap;
+  struct abuf literal;  // the pattern without escapes
+  char plain;           // while it is a fixed string
+};
+
+// a dfa built from an nfa as it runs. a state is the set of instructions
+// reached after a byte and the kind of that byte, which the assertions
+// look at. the state after byte c is trans[state * DFA_BYTES + c], or -1
+// until it is needed. byte 256 stands for the end of the text. states
+// are dropped all at once when there are DFA_STATES_MAX of them
+struct dfa {
+  struct regex *re;
+  struct nfa_inst *code;
+  char anchored;  // matches start at the first byte only
+  // bytes a match can start with, skipped to while no match is going on
+  unsigned char first[256];
+  int nfirst;
+  int firstbyte;  // the only one if nfirst is 1
+  int *trans;
+  int nstates;
+  int statecap;
+  int *sets;    // instructions of the states, sorted
+  int *setpos;  // the set of state s is sets[setpos[s], setpos[s + 1])
+  int setlen;
+  int setcap;
+  char *kind;  // enum RxKind of the byte before each state
+  int *hash;   // states by their set and kind, 1 based, 0 if free
+  // scratch space while a state is built
+  int *list;
+  int *stack;
+  int *mark;
+  int gen;
+};
+
+// the dfas running a regex, every thread searching has its own. fwd
+// finds where the first match ends, rev where matches start and match
+// where the match starting at a byte ends
+struct matcher {
+  struct regex *re;
+  int gen;  // search.gen of re
+  struct dfa fwd;
+  struct dfa rev;
+  struct dfa match;
+};
+
+// the last pattern searched for with / or ?
+struct search {
+  char *pattern;
+  int len;
+  int dir;  // 1 for /, -1 for ?
+  struct regex *re;  // the pattern compiled
+  int gen;           // changed with the pattern
+  struct matcher matcher;  // for the main thread
+  // matches in every chunk of SEARCH_BLOCK_ROWS rows, so n skips chunks
+  // without any. chunks before counted are right, the ones from the
+  // first row edited since are counted again before they are used
+  long *counts;
+  int counts_cap;
+  int counted;
+  long total;
+  // the match moved to last, shown as "match index of total" while the
+  // cursor stays on it
+  int row;
+  int cx;
+  long index;  // 0 if unknown
+};
+
+// worker threads counting the matches of a search, a chunk at a time.
+// the main thread counts chunks too and changes no row until the job
+// is done or given up
+struct search_pool {
+  pthread_t *threads;
+  struct matcher *matchers;  // one for each thread
+  int nthreads;  // -1 until they are started
+  pthread_mutex_t lock;
+  pthread_cond_t work;  // signaled when chunks are posted
+  pthread_cond_t idle;  // signaled when a worker is done with a chunk
+  int next;     // next chunk to count
+  int nchunks;  // chunks of the posted job
+  int busy;     // chunks being counted
+  char cancel;  // a key was pressed, stop taking chunks
+};
+
+// the pattern being typed after / or ?, its matches are highlighted and
+// the cursor moves to the next one as it is typed. the rows in the window
+// are searched at once, a thread looks for the match past them and
+// starts over whenever the pattern changes
+struct incsearch {
+  pthread_t thread;
+  char started;
+  pthread_mutex_t lock;
+  pthread_cond_t work;  // signaled when a scan is posted or may go on
+  pthread_cond_t idle;  // signaled when the thread stops reading rows
+  struct regex *re;     // the pattern typed so far, NULL if none or invalid
+  int gen;              // changed with re, the matchers follow it
+  struct matcher matcher;  // for the thread
+  struct matcher draw;     // for the main thread
+  int dir;
+  // rows [from[i], to[i]) are scanned for range <= i < 2, in dir order.
+  // next is where the range goes on, -1 before it starts. a to past the
+  // rows loaded so far waits for the rest of the file
+  int from[2];
+  int to[2];
+  int range;
+  int next;
+  char scanning;  // posted and no match found yet
+  char busy;      // the thread is reading rows
+  char pause;     // the main thread is changing rows or the pattern
+  char waiting;   // for more rows to be loaded
+  int found;      // row of the match found by the thread, -1 if none
+  int pos;
+  // the cursor and view when the prompt opened, restored when it closes
+  int cy;
+  int cx;
+  int row_offset;
+  int col_offset;
+  int row;  // the match the cursor moved to, -1 if none
+  int hit;
 };
 
 typedef struct editor_config {
   struct termios origin_termios;
-  win_size_t cx, cy;  // cursor position
+  int cx;  // cursor position, rows may be wider than 65535 columns
+  int cy;  // cursor row, files may have more than 65535 rows
   // todo render tab
-  win_size_t rx;       // index for render tab
-  win_size_t prev_cx;  // previous cursor's x coordinate
+  win_size_t rx;  // index for render tab
+  int prev_cx;    // previous cursor's x coordinate
   int row_offset;
   int col_offset;
   win_size_t winrows;
   win_size_t wincols;
   enum EditorMode mode;  // NORMAL_MODE, INSERT_MODE
 
+  // rows live in a gap buffer: row[0, gap) and row[gap + gaplen, rowcap),
+  // so inserting or deleting near the last edit only moves a few rows.
+  // always access rows through ed_row()
   TextRow *row;
   int numrows;
+  int rowcap;  // slots allocated for row, gaplen = rowcap - numrows
+  int gap;     // start of the gap
   int rownum_width;  // line number width for printf("%*d", width, data)
 
   char *filename;  // opend file name, if argc == 1, display as [No Name]
   char file_opened;
+  // the opened file is mapped and split into rows on demand, rows that are
+  // never edited keep pointing into the map instead of owning a copy
+  char *map;
+  size_t mapsize;
+  size_t mapread;  // bytes of map already published as rows
+  char map_heap;   // map was read into the heap, not mmap(2)ed
+  char loading;    // loader thread is running or has unpublished rows
+  struct row_loader load;
+  struct saver save;
+  struct journal journal;
+  struct undo undo;
+  struct arena arena;  // row strings and renders
+  // rows owning a render or highlight, the ones of rows off screen are
+  // freed once there are more than RCACHE_ROWS of them
+  int *rcache;
+  int rcache_len;
+  int rcache_cap;
+  // first row changed since the file was read or written, INT_MAX if none
+  int dirty_row;
+  // file offset of every SAVE_INDEX_ROWS-th row, offsets[k] is the offset
+  // of row k * SAVE_INDEX_ROWS and stays right while that is <= dirty_row
+  size_t *offsets;
+  int noffsets;
+  int offsets_cap;
+  char map_cr;  // the file has \r\n line ends, dropped from rows
+  struct syntax *syntax;  // NULL if the file is not highlighted
+  // rows before hl_rows end in the lexer state they were lexed to
+  int hl_rows;
+
   char commandmsg[100];
   time_t commandmsg_time;
+  // line read by ed_prompt(), shown instead of the command bar
+  struct abuf prompt;
+  char prompting;
+  struct search search;
+  struct search_pool pool;
+  struct incsearch incsearch;
+  struct reg *regs[REGISTERS];
+  int reg;               // picked with " for the next command
+  struct store *stores;  // by number, 0 is not used
+  int nstores;
+
+  // lines as last written to the terminal and the frame being drawn,
+  // ed_refresh() only writes what differs between them
+  struct abuf *screen;
+  struct abuf *frame;
+  int screen_lines;
+  char screen_valid;  // 0 after the terminal was cleared
+  int screen_row_offset;  // row_offset and TEXT_START the screen was drawn
+  int screen_text_start;  // with, to scroll it instead of redrawing it
+  int frame_bytes;        // bytes written by the last ed_refresh()
+  long frame_time;        // ms when the last frame was written
+
+  // input is read in bulk and decoded from inbuf by ed_read_key()
+  char inbuf[4096];
+  int inpos;
+  int inlen;
+  // written to by the SIGWINCH handler and the loader thread
+  // to wake the main loop from poll(2)
+  int wakefd[2];
+  volatile sig_atomic_t resized;
 } Editor;
 
 enum EditorKey {
@@ -65,6 +534,7 @@ enum EditorKey {
   END_KEY = 2004,
   PAGE_DOWN = 2005,
   PAGE_UP = 2006,
+  PASTE_KEY = 2007,  // \x1b[200~, the pasted text follows until \x1b[201~
 
   // real map key
   BACKSPACE = 127,
@@ -76,6 +546,12 @@ enum EditorKey {
   DOWN = 'j',
   LINE_START = '0',
   LINE_END = '$',
+  GOTO_LINE_KEY = 'G',
+  GOTO_KEY = 'g',  // gg
+  PERCENT_KEY = '%',
+  WORD_NEXT_KEY = 'w',
+  WORD_END_KEY = 'e',
+  WORD_BACK_KEY = 'b',
 
   NEWLINE_BEFORE_KEY = 'O',
   NEWLINE_AFTER_KEY = 'o',
@@ -85,6 +561,20 @@ enum EditorKey {
 
   JOIN_LINE_KEY = 'J',
 
+  SEARCH_FORWARD_KEY = '/',
+  SEARCH_BACKWARD_KEY = '?',
+  SEARCH_NEXT_KEY = 'n',
+  SEARCH_PREV_KEY = 'N',
+
+  UNDO_KEY = 'u',
+  DELETE_OP_KEY = 'd',
+  CHANGE_OP_KEY = 'c',
+  YANK_OP_KEY = 'y',
+  PUT_AFTER_KEY = 'p',
+  PUT_BEFORE_KEY = 'P',
+  REGISTER_KEY = '"',
+  COMMAND_KEY = ':',
+
   INSERT_MODE_KEY = 'i',
   NORMAL_MODE_KEY = '\x1b'
 };
@@ -102,8 +592,65 @@ enum EditorKey {
 #define NEWLINE_AFTER 1
 #define NEWLINE_INSERT 1
 #define NEWLINE_BEFORE 0
+#define ROWCAP_MIN 16
+#define GAP_LEN (editor.rowcap - editor.numrows)
+#define ED_LOADED() (!editor.loading)
+#define LOAD_CHUNK_MIN 256
+#define LOAD_CHUNK_MAX (64 * 1024)
+#define RCACHE_ROWS (4 * (int)editor.winrows)
+#define ESC_TIMEOUT 100        // ms to wait for the rest of an escape sequence
+#define COMMANDMSG_TIMEOUT 5  // seconds a command message stays
+#define FRAME_MS 16  // least ms between frames while input keeps coming
+#define PASTE_TIMEOUT 1000  // ms to wait for the rest of a paste
+#define PASTE_END "\x1b[201~"
+#define SAVE_IOV 512  // rows per writev(2), two iovecs each
+#define SAVE_TMP_SUFFIX ".vipXXXXXX"
+#define SAVE_REPORT_ROWS (64 * 1024)  // rows between save progress reports
+#define SAVE_INDEX_ROWS 1024          // rows between entries of offsets
+#define JOURNAL_SUFFIX ".swp"
+#define JOURNAL_MAGIC "VIPJ\2\0\0\0"
+#define JOURNAL_MAGIC_LEN 8
+#define JOURNAL_SYNC_MS 1000  // idle ms before the journal is fsynced
+#define JOURNAL_FLUSH_BYTES (1 << 20)  // records kept before they are written
+#define UNDO_LIMIT_MB 64  // default memory cap of the undo log
+#define SEARCH_BLOCK_ROWS (16 * 1024)  // rows searched between input checks
+#define SEARCH_THREADS_MAX 64
+#define INCSEARCH_ROWS 1024  // rows scanned between checks for a new pattern
+#define DFA_BYTES 257  // transitions of a dfa state, the last one at the end
+#define DFA_STATES_MAX 1024
+#define DFA_MATCH 1  // in a transition, a match ends before the byte
+#define DFA_IDLE 2   // in a transition, no match is going on after it
+#define LEX_STALE 0xff
+#define STORES_MAX 65536  // store numbers fit in TextRow.store
 static Editor editor;
 
+static void ed_update_rownum_width();
+static inline int ed_search_counted();
+static void ed_draw_matches(struct abuf *ab, TextRow *row,
+                            const unsigned char *hl, int filerow);
+static unsigned char *ed_row_hl(int rpos);
+static void ed_draw_span(struct abuf *ab, TextRow *row,
+                         const unsigned char *hl, int from, int to);
+static void ed_incsearch_pause();
+static void ed_incsearch_resume();
+static int ed_rx_to_pos(TextRow *row, int rx);
+static void ed_cursor_to(int rpos, int pos);
+static int ed_cursor_pos();
+static size_t ed_map_line(const char *map, size_t mapsize, size_t pos,
+                          size_t *linelen);
+
+// the row at rpos, skipping over the gap
+static inline TextRow *ed_row(int rpos) {
+  return &editor.row[rpos < editor.gap ? rpos : rpos + GAP_LEN];
+}
+
+// rows split from the map are rendered the first time they are shown
+static inline TextRow *ed_row_rendered(int rpos) {
+  TextRow *row = ed_row(rpos);
+  if (rpos < editor.numrows && row->render == NULL) ed_render_row(row);
+  return row;
+}
+
 /* terminal*/
 
 void die(const char *msg) {
@@ -114,6 +661,10 @@ void die(const char *msg) {
 }
 
 void disable_raw_mode() {
+  // stop bracketed paste
+  if (write(STDOUT_FILENO, "\x1b[?2004l", 8) != 8) {
+    // nothing to do
+  }
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &editor.origin_termios) == -1)
     die("disable_raw_mode");
 }
@@ -134,32 +685,165 @@ void enable_raw_mode() {
   raw.c_cflag |= (CS8);
   // turn off  "\n" to "\r\n" translation
   raw.c_oflag &= ~(OPOST);
-  raw.c_cc[VMIN] = 0;
-  // read timeout at 200 ms
-  // if don't set screen will not refresh until key press
-  raw.c_cc[VTIME] = 2;
+  // read blocks for at least a byte, ed_wait_input() polls before
+  // reading so the main loop sleeps until there is something to do
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
   // set back attr
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  // bracketed paste, pasted text comes between \x1b[200~ and \x1b[201~
+  // so it is inserted at once instead of typed key by key
+  if (write(STDOUT_FILENO, "\x1b[?2004h", 8) != 8) die("write");
 }
 
-int ed_read_key() {
-  int nread;
-  char c;
-  // read 1 byte and return;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
+static void ed_on_sigwinch(int sig) {
+  (void)sig;
+  editor.resized = 1;
+  ed_wake();
+}
+
+// wake the main loop, safe from signal handlers and other threads
+void ed_wake() {
+  int saved = errno;
+  // a full pipe already wakes it
+  if (write(editor.wakefd[1], "", 1) == -1 && errno != EAGAIN) {
+    // nothing to do
+  }
+  errno = saved;
+}
+
+static void init_wakeup() {
+  if (pipe(editor.wakefd) == -1) die("pipe");
+  for (int i = 0; i < 2; i++) {
+    fcntl(editor.wakefd[i], F_SETFL, O_NONBLOCK);
+    fcntl(editor.wakefd[i], F_SETFD, FD_CLOEXEC);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = ed_on_sigwinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+// read whatever is pending into inbuf, return bytes read
+static int ed_read_input() {
+  if (editor.inpos == editor.inlen) editor.inpos = editor.inlen = 0;
+  int room = sizeof(editor.inbuf) - editor.inlen;
+  if (room == 0) return 0;
+  int nread = read(STDIN_FILENO, &editor.inbuf[editor.inlen], room);
+  if (nread == -1) {
+    if (errno == EAGAIN || errno == EINTR) return 0;
+    die("read");
+  }
+  // the terminal is gone
+  if (nread == 0) exit(1);
+  editor.inlen += nread;
+  return nread;
+}
+
+// ms until the command message has to be cleared or the journal synced,
+// -1 for none
+static int ed_next_timeout() {
+  int timeout = -1;
+  time_t left = editor.commandmsg_time + COMMANDMSG_TIMEOUT - time(NULL);
+  if (editor.commandmsg_time != 0 && left > 0) timeout = left * 1000;
+  if (editor.journal.unsynced) {
+    long sync = editor.journal.write_time + JOURNAL_SYNC_MS - ed_now_ms();
+    if (sync < 0) sync = 0;
+    if (timeout == -1 || sync < timeout) timeout = sync;
+  }
+  return timeout;
+}
+
+// the window size changed, draw everything again
+static void ed_resize() {
+  editor.resized = 0;
+  win_size_t rows, cols;
+  if (get_winsize(&rows, &cols) == -1 || rows < 3) return;
+  editor.winrows = rows - 2;
+  editor.wincols = cols - TEXT_START;
+  ed_clear();
+}
+
+// block until there is input. resizes, rows loaded in the background,
+// save progress and expiring messages are handled meanwhile, each
+// followed by a repaint
+void ed_wait_input() {
+  while (editor.inpos == editor.inlen) {
+    // edits are written out before sleeping
+    ed_journal_flush();
+    // save.fd is -1 and ignored by poll(2) when no save is running
+    struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0},
+                            {editor.wakefd[0], POLLIN, 0},
+                            {editor.save.fd, POLLIN, 0}};
+    int timeout = ed_next_timeout();
+    int n = poll(fds, 3, timeout);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+
+    if (fds[2].revents) ed_save_poll();
+    if (fds[0].revents) ed_read_input();
+    if (editor.inpos != editor.inlen) break;
+
+    char drain[64];
+    while (read(editor.wakefd[0], drain, sizeof(drain)) > 0) {
+    }
+    if (editor.resized) ed_resize();
+    if (editor.loading) ed_load_publish();
+    if (editor.incsearch.re) ed_incsearch_poll();
+    if (n == 0) {
+      // the message timed out, stop waking up for it
+      if (time(NULL) - editor.commandmsg_time >= COMMANDMSG_TIMEOUT)
+        editor.commandmsg_time = 0;
+      ed_journal_sync();
+    }
+    ed_refresh();
+  }
+}
+
+// true if more input is already waiting, so the next frame can wait
+int ed_input_pending() {
+  if (editor.inpos < editor.inlen) return 1;
+  struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&fd, 1, 0) > 0 && ed_read_input() > 0;
+}
+
+// next input byte, waiting at most timeout ms, return 0 if there is none
+static int ed_read_byte(char *c, int timeout) {
+  if (editor.inpos == editor.inlen) {
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&fd, 1, timeout) <= 0 || ed_read_input() == 0) return 0;
   }
+  *c = editor.inbuf[editor.inpos++];
+  return 1;
+}
+
+int ed_read_key() {
+  char c = 0;
+  ed_wait_input();
+  ed_read_byte(&c, 0);
   // todo read F1 F2 ..., ignore in normal mode, show as <F1>, <F2> in insert
   // mode
   // read arrow key(\x1b[A, \x1b[B, \x1b[C, \x1b[D), Home, page up down,
   // end key
   if (c == '\x1b') {
     char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (ed_read_byte(&seq[0], ESC_TIMEOUT) != 1) return '\x1b';
+    if (ed_read_byte(&seq[1], ESC_TIMEOUT) != 1) return '\x1b';
     if (seq[0] == '[') {                     // seq[0]
       if (seq[1] >= '0' && seq[1] <= '9') {  // seq[1]
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        if (ed_read_byte(&seq[2], ESC_TIMEOUT) != 1) return '\x1b';
+        if (seq[1] == '2' && seq[2] == '0') {
+          // \x1b[200~ starts a paste, a stray \x1b[201~ is dropped
+          char end[2];
+          if (ed_read_byte(&end[0], ESC_TIMEOUT) != 1) return '\x1b';
+          if (ed_read_byte(&end[1], ESC_TIMEOUT) != 1) return '\x1b';
+          if (end[0] == '0' && end[1] == '~') return PASTE_KEY;
+          return '\x1b';
+        }
         if (seq[2] == '~') {  // seq[2]
           switch (seq[1]) {
             case '1':
@@ -208,6 +892,29 @@ int ed_read_key() {
   }
 }
 
+// read pasted text up to PASTE_END into ab, input after it is kept in inbuf
+void ed_read_paste(struct abuf *ab) {
+  int endlen = strlen(PASTE_END);
+  while (1) {
+    if (editor.inpos == editor.inlen) {
+      struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+      // the end never came, keep what was pasted
+      if (poll(&fd, 1, PASTE_TIMEOUT) <= 0 || ed_read_input() == 0) return;
+    }
+    // the end may be split between this read and the last one
+    int from = ab->len > endlen ? ab->len - endlen : 0;
+    ab_append(ab, &editor.inbuf[editor.inpos], editor.inlen - editor.inpos);
+    editor.inpos = editor.inlen;
+    char *end = memmem(&ab->b[from], ab->len - from, PASTE_END, endlen);
+    if (end) {
+      // give back what was read past the end
+      editor.inpos -= &ab->b[ab->len] - (end + endlen);
+      ab->len = end - ab->b;
+      return;
+    }
+  }
+}
+
 /**
  * @brief get win rows and cols
  * @retval return -1 when failed, return 0 when successd
@@ -235,7 +942,7 @@ int get_cursor_pos(win_size_t *rows, win_size_t *cols) {
   unsigned int i = 0;
 
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+    if (ed_read_byte(&buf[i], 1000) != 1) break;
     if (buf[i] == 'R') break;
     i++;
   }
@@ -254,59 +961,264 @@ void ed_move_cursor2(struct abuf *ab, win_size_t x, win_size_t y) {
 
 /* input */
 
-void ed_process_move(int key) {
-  TextRow *row = editor.numrows == 0 ? NULL : &editor.row[CURRENT_ROW];
+// the first column of the row at rpos that is not blank
+static int ed_first_nonblank(int rpos) {
+  TextRow *row = ed_row_rendered(rpos);
+  int i = 0;
+  while (i < row->rsize && (row->render[i] == ' ' || row->render[i] == '\t'))
+    i++;
+  return TEXT_START + i;
+}
+
+// class of a byte for word motions, a word is a run of one class other
+// than blank
+static inline int ed_word_class(unsigned char c) {
+  if (c == ' ' || c == '\t') return 0;
+  if (isalnum(c) || c == '_' || c >= 0x80) return 2;
+  return 1;
+}
+
+#ifdef ED_SIMD_X86
+// a bit for each byte of s[0, 16) that is not of class cls, the classes
+// of ed_word_class() worked out for 16 bytes at once
+static inline unsigned ed_class_mask(const char *s, int cls) {
+  __m128i b = _mm_loadu_si128((const __m128i *)s);
+  __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8(' ')),
+                               _mm_cmpeq_epi8(b, _mm_set1_epi8('\t')));
+  if (cls == 0) return ~_mm_movemask_epi8(blank) & 0xffff;
+  // letters folded to lower case, bytes from 0x80 on are negative
+  __m128i lower = _mm_or_si128(b, _mm_set1_epi8(0x20));
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(b, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(b, _mm_set1_epi8('9' + 1)));
+  __m128i other = _mm_or_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8('_')),
+                               _mm_cmplt_epi8(b, _mm_setzero_si128()));
+  unsigned word = _mm_movemask_epi8(
+      _mm_or_si128(_mm_or_si128(alpha, digit), other));
+  if (cls == 2) return ~word & 0xffff;
+  return word | _mm_movemask_epi8(blank);
+}
+#endif
+
+// the first index of s from i on, before end, whose byte is not of class
+// cls, end if there is none. minified files have lines of megabytes, they
+// are scanned 16 bytes at a time
+static int ed_class_skip(const char *s, int i, int end, int cls) {
+#ifdef ED_SIMD_X86
+  for (; i + 16 <= end; i += 16) {
+    unsigned mask = ed_class_mask(s + i, cls);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+  while (i < end && ed_word_class(s[i]) == cls) i++;
+  return i;
+}
+
+// the last index of s from i down whose byte is not of class cls, -1 if
+// there is none
+static int ed_class_skip_back(const char *s, int i, int cls) {
+#ifdef ED_SIMD_X86
+  for (; i >= 15; i -= 16) {
+    unsigned mask = ed_class_mask(s + i - 15, cls);
+    if (mask) return i - 15 + 31 - __builtin_clz(mask);
+  }
+#endif
+  while (i >= 0 && ed_word_class(s[i]) == cls) i--;
+  return i;
+}
+
+// w, the start of the next word. an empty row is a word too
+static void ed_word_next(int *rpos, int *pos) {
+  TextRow *row = ed_row(*rpos);
+  int i = *pos;
+  if (i < row->size) {
+    int cls = ed_word_class(row->string[i]);
+    if (cls) i = ed_class_skip(row->string, i, row->size, cls);
+  }
+  for (;;) {
+    i = ed_class_skip(row->string, i, row->size, 0);
+    if (i < row->size) break;
+    ed_load_rows(*rpos + 2);
+    // no word after it, stop at the end
+    if (*rpos + 1 >= editor.numrows) break;
+    row = ed_row(++*rpos);
+    i = 0;
+    if (row->size == 0) break;
+  }
+  *pos = i;
+}
+
+// e, the end of the word, or of the next one if already there
+static void ed_word_end(int *rpos, int *pos) {
+  TextRow *row = ed_row(*rpos);
+  int i = *pos + 1;
+  for (;;) {
+    i = ed_class_skip(row->string, i, row->size, 0);
+    if (i < row->size) break;
+    ed_load_rows(*rpos + 2);
+    if (*rpos + 1 >= editor.numrows) {
+      *pos = row->size ? row->size - 1 : 0;
+      return;
+    }
+    row = ed_row(++*rpos);
+    i = 0;
+  }
+  int cls = ed_word_class(row->string[i]);
+  *pos = ed_class_skip(row->string, i, row->size, cls) - 1;
+}
+
+// b, the start of the word, or of the one before if already there
+static void ed_word_back(int *rpos, int *pos) {
+  TextRow *row = ed_row(*rpos);
+  int i = (*pos < row->size ? *pos : row->size) - 1;
+  for (;;) {
+    i = ed_class_skip_back(row->string, i, 0);
+    if (i >= 0) break;
+    if (*rpos == 0) {
+      *pos = 0;
+      return;
+    }
+    row = ed_row(--*rpos);
+    i = row->size - 1;
+    if (row->size == 0) {
+      *pos = 0;
+      return;
+    }
+  }
+  int cls = ed_word_class(row->string[i]);
+  *pos = ed_class_skip_back(row->string, i, cls) + 1;
+}
+
+// move (rpos, pos) by n words with w, e or b
+static void ed_word_move(int key, int n, int *rpos, int *pos) {
+  while (n-- > 0) {
+    if (key == WORD_NEXT_KEY) {
+      ed_word_next(rpos, pos);
+    } else if (key == WORD_END_KEY) {
+      ed_word_end(rpos, pos);
+    } else {
+      ed_word_back(rpos, pos);
+    }
+  }
+}
+
+// the row n rows from cy, within the file. rows up to it are loaded
+static int ed_row_by(long n) {
+  long to = editor.cy + n;
+  if (to < 0) to = 0;
+  ed_load_rows(to + 1 < INT_MAX ? to + 1 : INT_MAX);
+  if (to >= editor.numrows) to = editor.numrows - 1;
+  return to > 0 ? to : 0;
+}
+
+// move the cursor by a motion key, n is the count typed before it, 0 if
+// none. the target is computed at once, not by moving n times
+void ed_process_move(int key, int n) {
+  TextRow *row = editor.numrows == 0 ? NULL : ed_row_rendered(CURRENT_ROW);
   int text_start = row ? TEXT_START : 0;
   // todo fix tab
-  // editor.cy won't >= editor.numrows
   // if row->size == 0, text_end = rownum_width
   int text_end = row ? TEXT_START + row->rsize - 1 : 0;
+  int count = n ? n : 1;
+  int cx = editor.cx;
+  int cy = editor.cy;
+  int first = 0;  // the target is the first non blank of its row
   switch (key) {
     case LEFT:
     case ARROW_LEFT:
-      if (editor.cx != text_start) {
-        editor.cx--;
-      }
+      cx = cx - text_start > count ? cx - count : text_start;
+      editor.cx = cx;
       editor.prev_cx = editor.cx;
       break;
     case RIGHT:
     case ARROW_RIGHT:
-      if (editor.cx != text_end) {
-        editor.cx++;
-      }
+      if (cx < text_end) cx = text_end - cx > count ? cx + count : text_end;
+      editor.cx = cx;
       editor.prev_cx = editor.cx;
       break;
     case ENTER:
     case DOWN:
     case ARROW_DOWN:
-      if (editor.cy < editor.numrows) {
-        editor.cy++;
-      }
+      cy = ed_row_by(count);
       break;
     case UP:
     case ARROW_UP:
-      if (editor.cy != 0) {
-        editor.cy--;
-      }
+      cy = cy > count ? cy - count : 0;
       break;
     case BACKSPACE:
     // 8 same as BACKSPACE
     case CTRL_KEY('h'):
-      // same as ARROW_LEFT
-      if (editor.cx != text_start) {
-        editor.cx--;
-      } else if (editor.cy != 0) {
-        editor.cy--;
-        editor.cx = editor.row[CURRENT_ROW].rsize + TEXT_START;
+      // same as ARROW_LEFT, going on at the end of the rows before
+      while (count > 0) {
+        if (cx - text_start >= count) {
+          cx -= count;
+          break;
+        }
+        count -= cx - text_start + 1;
+        if (cy == 0) {
+          cx = text_start;
+          break;
+        }
+        cy--;
+        int rsize = ed_row_rendered(cy)->rsize;
+        cx = TEXT_START + (rsize ? rsize - 1 : 0);
       }
+      editor.cx = cx;
+      editor.prev_cx = editor.cx;
+      break;
+    case PAGE_DOWN:
+      // from the bottom of the window, a window down for each count
+      cy = ed_row_by(editor.row_offset - cy + editor.winrows - 1 +
+                     (long)count * editor.winrows);
+      break;
+    case PAGE_UP:
+      cy = ed_row_by(editor.row_offset - cy - (long)count * editor.winrows);
+      break;
+    case CTRL_KEY('d'):
+    case CTRL_KEY('u'): {
+      // scroll the window and the cursor by half a window, or n rows
+      long by = n ? n : editor.winrows / 2 > 0 ? editor.winrows / 2 : 1;
+      if (key == CTRL_KEY('u')) by = -by;
+      if (row == NULL) break;
+      cy = ed_row_by(by);
+      long offset = editor.row_offset + by;
+      if (offset > editor.numrows - 1) offset = editor.numrows - 1;
+      editor.row_offset = offset > 0 ? offset : 0;
+    } break;
+    case GOTO_LINE_KEY:
+    case GOTO_KEY:
+      // G goes to the last row and gg to the first one, or both to row n
+      if (row == NULL) break;
+      if (n == 0 && key == GOTO_LINE_KEY) ed_load_rows(INT_MAX);
+      cy = ed_row_by((n ? n - 1 : key == GOTO_KEY ? 0 : editor.numrows - 1) -
+                     (long)cy);
+      first = 1;
+      break;
+    case WORD_NEXT_KEY:
+    case WORD_END_KEY:
+    case WORD_BACK_KEY: {
+      if (row == NULL) break;
+      int pos = ed_rx_to_pos(row, cx - TEXT_START);
+      ed_word_move(key, count, &cy, &pos);
+      ed_cursor_to(cy, pos);
       editor.prev_cx = editor.cx;
+    } break;
+    case PERCENT_KEY:
+      // to n percent of the file
+      if (row == NULL || n == 0 || n > 100) break;
+      ed_load_rows(INT_MAX);
+      cy = ((long)n * editor.numrows + 99) / 100 - 1;
+      first = 1;
       break;
     default:
       break;
   }
+  editor.cy = cy;
+  if (first) editor.prev_cx = ed_first_nonblank(CURRENT_ROW);
 
   // snap cursor to end of line or prev position
-  row = editor.numrows == 0 ? NULL : &editor.row[CURRENT_ROW];
+  row = editor.numrows == 0 ? NULL : ed_row_rendered(CURRENT_ROW);
   if (row) {
     // minus 1 only if row->size != 0,
     text_end = row ? TEXT_START + row->rsize : 0;
@@ -320,17 +1232,129 @@ void ed_process_move(int key) {
   }
 }
 
+// normal mode keys that are motions, as kept in Motion: the keys with the
+// same motion are mapped to one of them
+static int ed_motion_key(int c) {
+  switch (c) {
+    case ARROW_LEFT:
+      return LEFT;
+    case ARROW_RIGHT:
+      return RIGHT;
+    case ARROW_UP:
+      return UP;
+    case ARROW_DOWN:
+      return DOWN;
+    case HOME_KEY:
+      return LINE_START;
+    case END_KEY:
+      return LINE_END;
+    case PAGE_DOWN:
+      return CTRL_KEY('f');
+    case PAGE_UP:
+      return CTRL_KEY('b');
+    case LEFT:
+    case RIGHT:
+    case UP:
+    case DOWN:
+    case LINE_START:
+    case LINE_END:
+    case ENTER:
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+    case CTRL_KEY('d'):
+    case CTRL_KEY('u'):
+    case CTRL_KEY('f'):
+    case CTRL_KEY('b'):
+    case GOTO_LINE_KEY:
+    case GOTO_KEY:
+    case PERCENT_KEY:
+    case WORD_NEXT_KEY:
+    case WORD_END_KEY:
+    case WORD_BACK_KEY:
+      return c;
+    default:
+      return 0;
+  }
+}
+
+// read the count typed before a command, *c is its first key. return it,
+// 0 if there is none, and leave the key after it in *c
+static int ed_read_count(int *c) {
+  int n = 0;
+  // 0 is a motion unless it goes on a count
+  while ((*c >= '1' && *c <= '9') || (n && *c == '0')) {
+    if (n <= (INT_MAX - 9) / 10) n = n * 10 + *c - '0';
+    *c = ed_read_key();
+  }
+  return n;
+}
+
+// read [count]motion starting with key *c into m. return 0 if it is not a
+// motion, with the key after the count left in *c
+static int ed_read_motion(int *c, Motion *m) {
+  m->n = ed_read_count(c);
+  int key = ed_motion_key(*c);
+  if (key == 0) return 0;
+  m->motion[0] = key;
+  m->motion[1] = '\0';
+  if (key == GOTO_KEY) {
+    // only gg so far, g and the key after it are dropped
+    if (ed_read_key() != GOTO_KEY) return 0;
+    m->motion[1] = GOTO_KEY;
+    m->motion[2] = '\0';
+  }
+  return 1;
+}
+
+// move the cursor by a motion read by ed_read_motion()
+static void ed_motion(Motion *m) {
+  int key = (unsigned char)m->motion[0];
+  switch (key) {
+    case LINE_START:
+      editor.cx = editor.numrows != 0 ? TEXT_START : 0;
+      editor.prev_cx = editor.cx;
+      if (editor.col_offset > 0) {
+        editor.col_offset = 0;
+      }
+      break;
+    case LINE_END:
+      // the end of the row n - 1 rows down
+      if (m->n > 1) ed_process_move(DOWN, m->n - 1);
+      editor.cx = editor.numrows != 0
+                      ? TEXT_START + ed_row_rendered(CURRENT_ROW)->rsize - 1
+                      : 0;
+      editor.prev_cx = editor.cx;
+      break;
+    case CTRL_KEY('f'):
+      ed_process_move(PAGE_DOWN, m->n);
+      break;
+    case CTRL_KEY('b'):
+      ed_process_move(PAGE_UP, m->n);
+      break;
+    default:
+      ed_process_move(key, m->n);
+      break;
+  }
+}
+
 void ed_normal_process(int c) {
+  Motion m;
+  if (ed_read_motion(&c, &m)) {
+    ed_motion(&m);
+    return;
+  }
   switch (c) {
     case NORMAL_MODE_KEY:
     case CTRL_KEY('l'):
       break;
-      // todo use :w to save
+    case PASTE_KEY:
+      ed_paste();
+      break;
     case CTRL_KEY('s'):
       ed_save();
       break;
     case DEL_KEY:
-      ed_row_delete_char(&editor.row[CURRENT_ROW], CURRENT_COL);
+      ed_row_delete_char(ed_row(CURRENT_ROW), ed_cursor_pos());
       // DEL will back to normal mode and snap cursor
       to_normal_mode();
       // ed_process_move(ARROW_LEFT);
@@ -342,74 +1366,72 @@ void ed_normal_process(int c) {
       to_insert_mode();
       break;
     case CTRL_KEY('q'):
-      ed_clear();
-      exit(0);
-      break;
-    case LINE_START:
-    case HOME_KEY:
-      editor.cx = editor.numrows != 0 ? TEXT_START : 0;
-      editor.prev_cx = editor.cx;
-      if (editor.col_offset > 0) {
-        editor.col_offset = 0;
-      }
+      ed_quit();
       break;
-    case LINE_END:
-    case END_KEY:
-      editor.cx = editor.numrows != 0
-                      ? TEXT_START + editor.row[CURRENT_ROW].rsize - 1
-                      : 0;
-      editor.prev_cx = editor.cx;
+    case CTRL_KEY('g'):
+      ed_show_fileinfo();
       break;
-    case PAGE_DOWN:
-    case PAGE_UP: {
-      // move cursor to bottom
-      if (c == PAGE_DOWN) {
-        editor.cy = editor.row_offset + editor.winrows - 1;
-        if (editor.cy > editor.numrows) editor.cy = editor.numrows;
-      } else {
-        // move cursor to top
-        editor.cy = editor.row_offset;
-      }
-      int rows = editor.winrows;
-      while (rows--) {
-        ed_process_move(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-      }
-    } break;
     case NEWLINE_AFTER_KEY:
       ed_insert_newline(NEWLINE_AFTER);
       break;
     case NEWLINE_BEFORE_KEY:
       ed_insert_newline(NEWLINE_BEFORE);
       break;
-    case APPAND_CHAR_KEY:
+    case APPAND_CHAR_KEY: {
       to_insert_mode();
-      editor.cx++;
-      break;
+      if (editor.numrows == 0) break;
+      // after the byte under the cursor, which may be a wide tab
+      int pos = ed_cursor_pos();
+      if (pos < ed_row(CURRENT_ROW)->size) pos++;
+      ed_cursor_to(CURRENT_ROW, pos);
+    } break;
     case APPAND_LINE_KEY:
       to_insert_mode();
-      editor.cx = MAX_CX(editor.row[CURRENT_ROW]) + 1;
+      editor.cx = MAX_CX(*ed_row_rendered(CURRENT_ROW)) + 1;
+      break;
+    case SEARCH_FORWARD_KEY:
+    case SEARCH_BACKWARD_KEY:
+      if (editor.file_opened) ed_search(c == SEARCH_FORWARD_KEY ? 1 : -1);
+      break;
+    case SEARCH_NEXT_KEY:
+      ed_search_next(editor.search.dir);
+      break;
+    case SEARCH_PREV_KEY:
+      ed_search_next(-editor.search.dir);
+      break;
+    case COMMAND_KEY:
+      ed_command();
+      break;
+    case UNDO_KEY:
+      ed_undo();
+      break;
+    case DELETE_OP_KEY:
+    case CHANGE_OP_KEY:
+    case YANK_OP_KEY:
+      if (editor.file_opened) ed_operator(c, m.n);
+      break;
+    case PUT_AFTER_KEY:
+    case PUT_BEFORE_KEY:
+      if (editor.file_opened) ed_put(c == PUT_AFTER_KEY, m.n);
+      break;
+    case REGISTER_KEY: {
+      // "x picks register x for the command after it
+      int r = ed_read_key();
+      if (r != '"' && (r < 'a' || r > 'z')) break;
+      editor.reg = r == '"' ? 0 : r - 'a' + 1;
+      ed_normal_process(ed_read_key());
+      editor.reg = 0;
+    } break;
+    case CTRL_KEY('r'):
+      ed_redo();
       break;
     case JOIN_LINE_KEY: {
       if (CURRENT_ROW >= editor.numrows - 1) return;
-      TextRow *next_row = &editor.row[CURRENT_ROW + 1];
-      ed_joinstr2row(&editor.row[CURRENT_ROW], next_row->string,
+      TextRow *next_row = ed_row(CURRENT_ROW + 1);
+      ed_joinstr2row(ed_row(CURRENT_ROW), next_row->string,
                      next_row->size);
       ed_delete_row(CURRENT_ROW + 1);
     } break;
-    case ENTER:
-    case BACKSPACE:
-    // 8 same as BACKSPACE
-    case CTRL_KEY('h'):
-    case ARROW_DOWN:
-    case DOWN:
-    case ARROW_UP:
-    case UP:
-    case ARROW_LEFT:
-    case LEFT:
-    case ARROW_RIGHT:
-    case RIGHT:
-      ed_process_move(c);
-      break;
     default:
       break;
   }
@@ -424,17 +1446,20 @@ void ed_insert_process(int c) {
     case ARROW_UP:
     case ARROW_LEFT:
     case ARROW_RIGHT:
-      ed_process_move(c);
+      ed_process_move(c, 0);
       break;
     case ENTER:
       ed_insert_newline(NEWLINE_INSERT);
       break;
+    case PASTE_KEY:
+      ed_paste();
+      break;
     case BACKSPACE:
     case CTRL_KEY('h'):
-      ed_delete_char_row(CURRENT_COL - 1);
+      ed_delete_char_row(ed_cursor_pos() - 1);
       break;
     case DEL_KEY:
-      ed_row_delete_char(&editor.row[CURRENT_ROW], CURRENT_COL);
+      ed_row_delete_char(ed_row(CURRENT_ROW), ed_cursor_pos());
       // DEL will back to normal mode and snap cursor
       to_normal_mode();
       break;
@@ -449,10 +1474,55 @@ void ed_process_keypress() {
   if (editor.mode == INSERT_MODE) {
     ed_insert_process(key);
   } else if (editor.mode == NORMAL_MODE) {
+    // edits of a command are undone together, the ones of the insert mode
+    // it may start too
+    ed_undo_seal();
     ed_normal_process(key);
   }
 }
 
+// read a line in the command bar after prefix, return it without the
+// prefix, or NULL if it was cancelled with ESC or by deleting the prefix.
+// callback, if any, is called with the line each time it changes
+char *ed_prompt(const char *prefix, void (*callback)(const char *, int)) {
+  struct abuf *in = &editor.prompt;
+  int prefixlen = strlen(prefix);
+  in->len = 0;
+  ab_append(in, prefix, prefixlen);
+  editor.prompting = 1;
+  char *line = NULL;
+  while (1) {
+    ed_refresh();
+    int c = ed_read_key();
+    if (c == NORMAL_MODE_KEY) break;
+    if (c == ENTER) {
+      line = strndup(in->b + prefixlen, in->len - prefixlen);
+      break;
+    }
+    int len = in->len;
+    if (c == BACKSPACE || c == CTRL_KEY('h')) {
+      if (--in->len < prefixlen) break;
+    } else if (c == PASTE_KEY) {
+      // the first line of it
+      struct abuf paste = ABUF_INIT;
+      paste.b = malloc(paste.cap);
+      ed_read_paste(&paste);
+      int n = 0;
+      while (n < paste.len && paste.b[n] != '\r' && paste.b[n] != '\n') n++;
+      ab_append(in, paste.b, n);
+      ab_free(&paste);
+    } else if (c < 1000 && (unsigned char)c >= ' ' && c != BACKSPACE) {
+      char ch = c;
+      ab_append(in, &ch, 1);
+    }
+    if (callback && in->len != len) {
+      callback(in->b + prefixlen, in->len - prefixlen);
+    }
+  }
+  editor.prompting = 0;
+  return line;
+}
+
 /* output */
 
 int println(const char *fmt, ...) {
@@ -490,9 +1560,10 @@ void ed_scroll() {
   }
 
   // scroll left
-  // min cx is TEXT_START
+  // min cx is TEXT_START, but cx sits on TEXT_START - 1 on an empty line
   if (editor.cx - TEXT_START < editor.col_offset) {
     editor.col_offset = editor.cx - TEXT_START;
+    if (editor.col_offset < 0) editor.col_offset = 0;
   }
   // scroll right
   if (editor.cx >= editor.col_offset + editor.wincols) {
@@ -500,9 +1571,11 @@ void ed_scroll() {
   }
 }
 
-void ed_draw_rows(struct abuf *ab) {
+// ab holds one abuf per window row
+void ed_draw_rows(struct abuf *lines) {
   int y;
   for (y = 0; y < editor.winrows; y++) {
+    struct abuf *ab = &lines[y];
     int filerow = y + editor.row_offset;
     if (filerow >= editor.numrows) {
       ab_append(ab, "~", 1);
@@ -531,20 +1604,21 @@ void ed_draw_rows(struct abuf *ab) {
                             editor.rownum_width, filerow + 1);
       ab_append(ab, linenum, numlen);
 
-      int len = editor.row[filerow].rsize - editor.col_offset;
-      // int len = editor.row[filerow].rsize;
+      TextRow *row = ed_row_rendered(filerow);
+      unsigned char *hl = editor.syntax ? ed_row_hl(filerow) : NULL;
+      if (editor.incsearch.re) {
+        ed_draw_matches(ab, row, hl, filerow);
+        continue;
+      }
+      int len = row->rsize - editor.col_offset;
+      // int len = row->rsize;
       if (len < 0) len = 0;
       if (len > editor.wincols) len = editor.wincols;
-      ab_append(ab, editor.row[filerow].render + editor.col_offset, len);
-      // ab_append(ab, editor.row[filerow].render, len);
+      ed_draw_span(ab, row, hl, editor.col_offset, editor.col_offset + len);
+      // ab_append(ab, ed_row(filerow)->render, len);
     }
-    //  0 erases the part of the line to the right of the cursor.
-    // 0 is the  default argument,
-    // so we leave out the argument and just use <esc>[K.
-    ab_append(ab, "\x1b[K", 3);
-    // if (y < editor.winrows - 1)
-    ab_append(ab, "\r\n", 2);
   }
+  ed_rcache_evict();
 }
 
 void ed_draw_statusbar(struct abuf *ab) {
@@ -557,19 +1631,31 @@ void ed_draw_statusbar(struct abuf *ab) {
   int statuslen = strlen(editor.filename);
   ab_append(ab, editor.filename, statuslen);
 
-  char buf1[40];
-  int linelen =
-      snprintf(buf1, sizeof(buf1), "Ln%hu,Col%hu  %d lines", editor.cy + 1,
-               editor.cx + 1 - TEXT_START, editor.numrows);
+  char buf1[96];
+  int linelen = 0;
+  // while the cursor is on the match the last search moved to
+  struct search *s = &editor.search;
+  if (s->index && editor.cy == s->row && editor.cx == s->cx &&
+      !editor.prompting && ed_search_counted()) {
+    linelen = snprintf(buf1, sizeof(buf1), "match %ld of %ld  ", s->index,
+                       s->total);
+  }
+  linelen += snprintf(buf1 + linelen, sizeof(buf1) - linelen,
+                      "Ln%d,Col%d  %d lines", editor.cy + 1,
+                      editor.cx + 1 - TEXT_START, editor.numrows);
+  // the count keeps growing while the file is loading
+  if (!ED_LOADED()) {
+    linelen += snprintf(buf1 + linelen, sizeof(buf1) - linelen, " (%d%%)",
+                        (int)(editor.mapread * 100 / editor.mapsize));
+  }
   int margin = editor.wincols + TEXT_START - statuslen - linelen;  //- 1;
-  while (margin--) {
+  while (margin-- > 0) {
     ab_append(ab, " ", 1);
   }
   ab_append(ab, buf1, linelen);
 
   // back to normal color
   ab_append(ab, "\x1b[m", 3);
-  ab_append(ab, "\r\n", 2);
 }
 
 void ed_set_commandmsg(const char *fmt, ...) {
@@ -582,55 +1668,221 @@ void ed_set_commandmsg(const char *fmt, ...) {
 }
 
 void ed_draw_commandbar(struct abuf *ab) {
-  // clear line
-  ab_append(ab, "\x1b[K", 3);
+  if (editor.prompting) {
+    // the end of a line too long for the window
+    int room = WIN_MAX_LENGTH - 1;
+    int skip = editor.prompt.len > room ? editor.prompt.len - room : 0;
+    ab_append(ab, editor.prompt.b + skip, editor.prompt.len - skip);
+    return;
+  }
   char buf[20];
   int modelen = snprintf(
       buf, sizeof(buf), "%s",
       editor.mode == NORMAL_MODE ? "-- NORMAL --  " : "-- INSERT --  ");
   ab_append(ab, buf, modelen);
-  if (time(NULL) - editor.commandmsg_time < 5) {
-    int size = sizeof(editor.commandmsg);
-    ab_append(ab, editor.commandmsg,
-              size > WIN_MAX_LENGTH ? WIN_MAX_LENGTH : size);
+  if (time(NULL) - editor.commandmsg_time < COMMANDMSG_TIMEOUT) {
+    // the mode takes the front of the line, a wrapped line would scroll
+    int size = strlen(editor.commandmsg);
+    int room = WIN_MAX_LENGTH - modelen;
+    ab_append(ab, editor.commandmsg, size > room ? room : size);
   }
 }
 
 void ed_clear() {
+  editor.screen_valid = 0;
   // clear screen
   write(STDOUT_FILENO, "\x1b[2J", 4);
   // reposition cursor
   write(STDOUT_FILENO, "\x1b[H", 3);
 }
 
-// refresh(clear and repaint) screen after every key press,
-// render text, draw bar and do many other stuffs.
+// end of the escape sequence starting at s[i]
+static int ed_escape_end(const char *s, int i, int len) {
+  i++;
+  if (i < len && s[i] == '[') {
+    i++;
+    while (i < len && (s[i] < 0x40 || s[i] > 0x7e)) i++;
+  }
+  return i < len ? i + 1 : len;
+}
+
+static int ed_has_escape(const char *s, int len) {
+  return len > 0 && memchr(s, '\x1b', len) != NULL;
+}
+
+// write screen line y so that it shows new instead of old. only the span
+// from the first changed byte is written, after replaying the escape
+// sequences in front of it so it gets the same attributes
+static void ed_diff_line(struct abuf *ab, int y, struct abuf *old,
+                         struct abuf *new) {
+  if (old && old->len == new->len && memcmp(old->b, new->b, new->len) == 0)
+    return;
+
+  int d = 0;
+  if (old) {
+    while (d < old->len && d < new->len && old->b[d] == new->b[d]) d++;
+  }
+  // screen column of d, don't start inside an escape sequence
+  int col = 0, attrs = 0;
+  for (int i = 0; i < d;) {
+    if (new->b[i] == '\x1b') {
+      int end = ed_escape_end(new->b, i, new->len);
+      if (end > d) {
+        d = i;
+        break;
+      }
+      attrs = 1;
+      i = end;
+    } else {
+      col++;
+      i++;
+    }
+  }
+
+  ed_move_cursor2(ab, col, y);
+  for (int i = 0; i < d;) {
+    if (new->b[i] == '\x1b') {
+      int end = ed_escape_end(new->b, i, new->len);
+      ab_append(ab, &new->b[i], end - i);
+      i = end;
+    } else {
+      i++;
+    }
+  }
+
+  // same length, only a span in the middle changed
+  if (old && old->len == new->len) {
+    int e = new->len;
+    while (e > d && old->b[e - 1] == new->b[e - 1]) e--;
+    if (!ed_has_escape(&old->b[d], e - d) &&
+        !ed_has_escape(&new->b[d], e - d)) {
+      ab_append(ab, &new->b[d], e - d);
+      if (attrs) ab_append(ab, "\x1b[m", 3);
+      return;
+    }
+  }
+
+  ab_append(ab, &new->b[d], new->len - d);
+  //  0 erases the part of the line to the right of the cursor.
+  // 0 is the  default argument,
+  // so we leave out the argument and just use <esc>[K.
+  ab_append(ab, "\x1b[K", 3);
+  if (attrs) ab_append(ab, "\x1b[m", 3);
+}
+
+// keep one abuf per screen line in both screen and frame
+static void ed_screen_resize(int lines) {
+  if (lines == editor.screen_lines) return;
+  for (int y = 0; y < editor.screen_lines; y++) {
+    ab_free(&editor.screen[y]);
+    ab_free(&editor.frame[y]);
+  }
+  editor.screen = realloc(editor.screen, sizeof(struct abuf) * lines);
+  editor.frame = realloc(editor.frame, sizeof(struct abuf) * lines);
+  if (editor.screen == NULL || editor.frame == NULL) die("realloc");
+  struct abuf empty = ABUF_INIT;
+  for (int y = 0; y < lines; y++) {
+    editor.screen[y] = editor.frame[y] = empty;
+    editor.screen[y].b = malloc(empty.cap);
+    editor.frame[y].b = malloc(empty.cap);
+  }
+  editor.screen_lines = lines;
+  editor.screen_valid = 0;
+}
+
+long ed_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// when the window moved up or down by less than its height, let the
+// terminal scroll the text lines with a scroll region (DECSTBM) and SU/SD,
+// and shift the screen lines to match. the lines scrolled in are blank,
+// so the diff only has to draw those
+static void ed_scroll_screen(struct abuf *ab) {
+  int delta = editor.row_offset - editor.screen_row_offset;
+  int rows = editor.winrows;
+  if (!editor.screen_valid || delta == 0 || abs(delta) >= rows ||
+      editor.screen_text_start != TEXT_START)
+    return;
+
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows,
+                     abs(delta), delta > 0 ? 'S' : 'T');
+  ab_append(ab, buf, len);
+
+  // rotate the text lines, the abufs move with their buffers
+  struct abuf *lines = editor.screen;
+  struct abuf moved[abs(delta)];
+  if (delta > 0) {
+    memcpy(moved, lines, sizeof(struct abuf) * delta);
+    memmove(lines, &lines[delta], sizeof(struct abuf) * (rows - delta));
+    memcpy(&lines[rows - delta], moved, sizeof(struct abuf) * delta);
+    for (int y = rows - delta; y < rows; y++) lines[y].len = 0;
+  } else {
+    delta = -delta;
+    memcpy(moved, &lines[rows - delta], sizeof(struct abuf) * delta);
+    memmove(&lines[delta], lines, sizeof(struct abuf) * (rows - delta));
+    memcpy(lines, moved, sizeof(struct abuf) * delta);
+    for (int y = 0; y < delta; y++) lines[y].len = 0;
+  }
+}
+
+// refresh screen after every key press, render text, draw bar and do
+// many other stuffs. the frame is drawn off screen first, then only
+// the lines that changed since the last refresh are written.
 // called in main loop
 void ed_refresh() {
   ed_scroll();
+  // split just enough of the file to fill the window
+  ed_load_rows(editor.row_offset + editor.winrows + 1);
+
+  int lines = editor.winrows + 2;
+  ed_screen_resize(lines);
+  for (int y = 0; y < lines; y++) {
+    editor.frame[y].len = 0;
+  }
+  ed_draw_rows(editor.frame);
+  ed_draw_statusbar(&editor.frame[editor.winrows]);
+  ed_draw_commandbar(&editor.frame[editor.winrows + 1]);
 
   struct abuf ab = ABUF_INIT;
   ab.b = malloc(ab.cap);
   // hide cursor
   ab_append(&ab, "\x1b[?25l", 6);
 
-  // ab_append(&ab, "\x1b[2J", 4); //clear entire screen`;
-  // reposition cursor
-  ab_append(&ab, "\x1b[H", 3);
-
-  ed_draw_rows(&ab);
-  ed_draw_statusbar(&ab);
-  ed_draw_commandbar(&ab);
+  ed_scroll_screen(&ab);
+  for (int y = 0; y < lines; y++) {
+    ed_diff_line(&ab, y, editor.screen_valid ? &editor.screen[y] : NULL,
+                 &editor.frame[y]);
+  }
 
   // move the cursor
-  ed_move_cursor2(&ab, editor.cx - editor.col_offset,
-                  editor.cy - editor.row_offset);
+  if (editor.prompting) {
+    int x = editor.prompt.len < WIN_MAX_LENGTH - 1 ? editor.prompt.len
+                                                   : WIN_MAX_LENGTH - 1;
+    ed_move_cursor2(&ab, x, editor.winrows + 1);
+  } else {
+    ed_move_cursor2(&ab, editor.cx - editor.col_offset,
+                    editor.cy - editor.row_offset);
+  }
 
   // show cursor
   ab_append(&ab, "\x1b[?25h", 6);
 
   write(STDOUT_FILENO, ab.b, ab.len);
+  editor.frame_bytes = ab.len;
+  editor.frame_time = ed_now_ms();
   ab_free(&ab);
+
+  // the frame is on screen now
+  struct abuf *screen = editor.screen;
+  editor.screen = editor.frame;
+  editor.frame = screen;
+  editor.screen_valid = 1;
+  editor.screen_row_offset = editor.row_offset;
+  editor.screen_text_start = TEXT_START;
 }
 
 /* append buf */
@@ -650,79 +1902,411 @@ void ab_append(struct abuf *ab, const char *s, int len) {
 
 void ab_free(struct abuf *ab) { free(ab->b); }
 
+/* row allocator */
+
+// split what is left of the newest slab into free blocks,
+// largest classes first
+static void ar_carve(struct arena *ar) {
+  int shift = ARENA_MAX_SHIFT;
+  while (ar->left >= (1 << ARENA_MIN_SHIFT)) {
+    while ((size_t)(1 << shift) > ar->left) shift--;
+    char **head = &ar->free[shift - ARENA_MIN_SHIFT];
+    memcpy(ar->top, head, sizeof(char *));
+    *head = ar->top;
+    ar->top += 1 << shift;
+    ar->left -= 1 << shift;
+  }
+}
+
+// return a block of at least size bytes, its real size is stored in cap
+void *ar_alloc(struct arena *ar, int size, int *cap) {
+  int shift = ARENA_MIN_SHIFT;
+  while ((1 << shift) < size) shift++;
+  *cap = 1 << shift;
+  ar->calls++;
+  ar->allocated += *cap;
+
+  if (shift > ARENA_MAX_SHIFT) {
+    char *p = malloc(*cap);
+    if (p == NULL) die("malloc");
+    ar->reserved += *cap;
+    return p;
+  }
+
+  char **head = &ar->free[shift - ARENA_MIN_SHIFT];
+  if (*head) {
+    char *p = *head;
+    memcpy(head, p, sizeof(char *));
+    return p;
+  }
+
+  if (ar->left < (size_t)*cap) {
+    ar_carve(ar);
+    char *slab = malloc(ARENA_SLAB);
+    if (slab == NULL) die("malloc");
+    memcpy(slab, &ar->slabs, sizeof(char *));
+    ar->slabs = slab;
+    ar->top = slab + ARENA_HEADER;
+    ar->left = ARENA_SLAB - ARENA_HEADER;
+    ar->reserved += ARENA_SLAB;
+  }
+  char *p = ar->top;
+  ar->top += *cap;
+  ar->left -= *cap;
+  return p;
+}
+
+// cap must be the one returned by ar_alloc()
+void ar_free(struct arena *ar, void *p, int cap) {
+  ar->allocated -= cap;
+  if (cap > ARENA_MAX_BLOCK) {
+    free(p);
+    ar->reserved -= cap;
+    return;
+  }
+  int shift = ARENA_MIN_SHIFT;
+  while ((1 << shift) < cap) shift++;
+  char **head = &ar->free[shift - ARENA_MIN_SHIFT];
+  memcpy(p, head, sizeof(char *));
+  *head = p;
+}
+
+// release all slabs at once, blocks bigger than ARENA_MAX_BLOCK must be
+// freed by ar_free() before
+void ar_free_all(struct arena *ar) {
+  while (ar->slabs) {
+    char *slab = ar->slabs;
+    memcpy(&ar->slabs, slab, sizeof(char *));
+    free(slab);
+  }
+  struct arena empty = ARENA_INIT;
+  *ar = empty;
+}
+
 /* row ops */
 
-// renders tabs as multiple spaces
-void ed_render_row(TextRow *row) {
+// count tabs in s[0, len)
+static int ed_count_tabs(const char *s, int len) {
   int tabs = 0;
-  for (int i = 0; i < row->size; i++) {
-    if (row->string[i] == '\t') tabs++;
+  const char *end = s + len;
+  while ((s = memchr(s, '\t', end - s)) != NULL) {
+    tabs++;
+    s++;
   }
+  return tabs;
+}
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (TAB_SIZE - 1) + 1);
+// expand s[0, len) into render, return the rendered size
+static int ed_expand_tabs(char *render, const char *s, int len) {
+  const char *end = s + len;
+  char *r = render;
+  while (s < end) {
+    const char *tab = memchr(s, '\t', end - s);
+    int run = (tab ? tab : end) - s;
+    memcpy(r, s, run);
+    r += run;
+    s += run;
+    if (tab) {
+      memset(r, ' ', TAB_SIZE);
+      r += TAB_SIZE;
+      s++;
+    }
+  }
+  return r - render;
+}
 
-  int cnt = 0;
-  for (int i = 0; i < row->size; i++) {
-    if (row->string[i] == '\t') {
-      for (int j = 0; j < TAB_SIZE; j++) {
-        row->render[cnt++] = ' ';
-      }
+// make sure row->render can hold rsize bytes plus '\0', keeping its content
+static void ed_render_reserve(TextRow *row, int rsize) {
+  if (rsize + 1 <= row->rcap) return;
+  int rcap;
+  char *render = ar_alloc(&editor.arena, rsize + 1, &rcap);
+  if (row->render) {
+    memcpy(render, row->render, row->rsize + 1);
+    ar_free(&editor.arena, row->render, row->rcap);
+  }
+  row->render = render;
+  row->rcap = rcap;
+}
+
+// index of a row pointer, the inverse of ed_row()
+static inline int ed_row_index(TextRow *row) {
+  int i = row - editor.row;
+  return i < editor.gap ? i : i - GAP_LEN;
+}
+
+static void ed_rcache_add(int rpos) {
+  if (editor.rcache_len == editor.rcache_cap) {
+    editor.rcache_cap = editor.rcache_cap ? editor.rcache_cap * 2 : 64;
+    editor.rcache = realloc(editor.rcache, sizeof(int) * editor.rcache_cap);
+    if (editor.rcache == NULL) die("realloc");
+  }
+  editor.rcache[editor.rcache_len++] = rpos;
+}
+
+// keep rcache in step with rows inserted (n > 0) or deleted (n < 0) at rpos
+static void ed_rcache_shift(int rpos, int n) {
+  int len = 0;
+  for (int i = 0; i < editor.rcache_len; i++) {
+    int r = editor.rcache[i];
+    if (n < 0 && r >= rpos && r < rpos - n) continue;  // deleted
+    editor.rcache[len++] = r >= rpos ? r + n : r;
+  }
+  editor.rcache_len = len;
+}
+
+// free a render owned by the row, it is rendered again when shown
+static void ed_render_free(TextRow *row) {
+  if (row->rcap) ar_free(&editor.arena, row->render, row->rcap);
+  row->render = NULL;
+  row->rsize = row->rcap = 0;
+}
+
+// free the row's highlight, it is lexed again when shown
+static void ed_hl_free(TextRow *row) {
+  if (row->hlcap) ar_free(&editor.arena, row->hl, row->hlcap);
+  row->hl = NULL;
+  row->hlcap = 0;
+}
+
+static int ed_cmp_int(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+// free renders and highlights of rows off screen once too many rows own
+// one
+void ed_rcache_evict() {
+  if (editor.rcache_len <= RCACHE_ROWS) return;
+  qsort(editor.rcache, editor.rcache_len, sizeof(int), ed_cmp_int);
+  int len = 0;
+  for (int i = 0; i < editor.rcache_len; i++) {
+    int r = editor.rcache[i];
+    if (len > 0 && editor.rcache[len - 1] == r) continue;
+    if (r >= editor.numrows) continue;
+    TextRow *row = ed_row(r);
+    if (row->rcap == 0 && row->hlcap == 0) continue;
+    if (r < editor.row_offset || r >= editor.row_offset + editor.winrows) {
+      ed_render_free(row);
+      ed_hl_free(row);
+      continue;
+    }
+    editor.rcache[len++] = r;
+  }
+  editor.rcache_len = len;
+}
+
+// renders tabs as multiple spaces,
+// a row without tabs is shown straight from its string
+void ed_render_row(TextRow *row) {
+  int tabs = ed_count_tabs(row->string, row->size);
+  if (tabs == 0) {
+    if (row->rcap) ed_render_free(row);
+    row->render = row->string;
+    row->rsize = row->size;
+    return;
+  }
+
+  int rsize = row->size + tabs * (TAB_SIZE - 1);
+  if (rsize + 1 > row->rcap) {
+    if (row->rcap) {
+      ar_free(&editor.arena, row->render, row->rcap);
     } else {
-      row->render[cnt++] = row->string[i];
+      ed_rcache_add(ed_row_index(row));
     }
+    row->render = ar_alloc(&editor.arena, rsize + 1, &row->rcap);
   }
-  row->render[cnt] = '\0';
-  row->rsize = cnt;
+  row->rsize = ed_expand_tabs(row->render, row->string, row->size);
+  row->render[row->rsize] = '\0';
 }
 
-// insert a new row, just like ed_row_insert
-void ed_insert_row(int rpos, char *s, size_t len) {
-  if (rpos < 0 || rpos > editor.numrows) return;
+// render index of string index pos. every tab is TAB_SIZE wide wherever
+// it is, so only the tabs before pos matter. the render must match the
+// string except for len bytes just inserted at pos
+static int ed_render_pos(TextRow *row, int pos, int len) {
+  int tabs = (row->rsize - (row->size - len)) / (TAB_SIZE - 1);
+  if (tabs == 0) return pos;
+  // count on the shorter side of pos
+  int before;
+  if (pos <= row->size - pos - len) {
+    before = ed_count_tabs(row->string, pos);
+  } else {
+    before = tabs - ed_count_tabs(&row->string[pos + len],
+                                  row->size - pos - len);
+  }
+  return pos + before * (TAB_SIZE - 1);
+}
+
+// len bytes were inserted into the string at pos, patch them into the
+// render instead of rendering the whole row again
+static void ed_render_insert(TextRow *row, int pos, int len) {
+  if (row->render == NULL) return;  // rendered when it is shown
+  if (row->rcap == 0) {
+    if (memchr(&row->string[pos], '\t', len)) {
+      ed_render_row(row);
+    } else {
+      row->render = row->string;
+      row->rsize = row->size;
+    }
+    return;
+  }
+  int rx = ed_render_pos(row, pos, len);
+  int width = len + ed_count_tabs(&row->string[pos], len) * (TAB_SIZE - 1);
+  ed_render_reserve(row, row->rsize + width);
+  memmove(&row->render[rx + width], &row->render[rx], row->rsize - rx + 1);
+  ed_expand_tabs(&row->render[rx], &row->string[pos], len);
+  row->rsize += width;
+}
+
+// len bytes at pos are about to be deleted from the string,
+// cut them out of the render
+static void ed_render_delete(TextRow *row, int pos, int len) {
+  if (row->render == NULL || len <= 0) return;
+  if (row->rcap == 0) {
+    row->rsize -= len;
+    return;
+  }
+  int rx = ed_render_pos(row, pos, 0);
+  int width = len + ed_count_tabs(&row->string[pos], len) * (TAB_SIZE - 1);
+  memmove(&row->render[rx], &row->render[rx + width],
+          row->rsize - rx - width + 1);
+  row->rsize -= width;
+  // the last tab is gone, show the string again
+  if (row->rsize == row->size - len) {
+    ed_render_free(row);
+    row->render = row->string;
+    row->rsize = row->size - len;
+  }
+}
+
+// move the gap so that it starts at rpos,
+// only the rows between the old and new gap are moved
+static void ed_move_gap(int rpos) {
+  int gaplen = GAP_LEN;
+  if (rpos < editor.gap) {
+    memmove(&editor.row[rpos + gaplen], &editor.row[rpos],
+            sizeof(TextRow) * (editor.gap - rpos));
+  } else if (rpos > editor.gap) {
+    memmove(&editor.row[editor.gap], &editor.row[editor.gap + gaplen],
+            sizeof(TextRow) * (rpos - editor.gap));
+  }
+  editor.gap = rpos;
+}
+
+// make sure the gap can hold n more rows, doubling rowcap
+static void ed_grow_gap(int n) {
+  if (GAP_LEN >= n) return;
+  int cap = editor.rowcap ? editor.rowcap : ROWCAP_MIN;
+  while (cap - editor.numrows < n) cap *= 2;
+
+  TextRow *rows = realloc(editor.row, sizeof(TextRow) * cap);
+  if (rows == NULL) die("realloc");
+  // rows after the gap stay at the end of the buffer
+  int after = editor.numrows - editor.gap;
+  memmove(&rows[cap - after], &rows[editor.rowcap - after],
+          sizeof(TextRow) * after);
+  editor.row = rows;
+  editor.rowcap = cap;
+}
+
+// make sure row->string can hold size bytes plus '\0', moving it to the
+// next size class when it is full.
+// a row still pointing into the map or a store gets its own copy here
+static void ed_row_reserve(TextRow *row, int size) {
+  if (size + 1 <= row->cap) return;
+  int cap;
+  char *string = ar_alloc(&editor.arena, size + 1, &cap);
+  if (row->string) memcpy(string, row->string, row->size);
+  if (row->cap) ar_free(&editor.arena, row->string, row->cap);
+  if (row->store) ed_store_unref(row->store);
+  row->store = 0;
+  if (row->rcap == 0 && row->render) row->render = string;
+  row->string = string;
+  row->string[row->size] = '\0';
+  row->cap = cap;
+}
+
+// called before a row is modified in place
+static inline void ed_row_own(TextRow *row) { ed_row_reserve(row, row->size); }
 
-  editor.row = realloc(editor.row, sizeof(TextRow) * (editor.numrows + 1));
-  // move all rows below rpos(included)
-  // down one row that makes room for new row
-  // if rpos equals numrows, it does nothing
-  memmove(&editor.row[rpos + 1], &editor.row[rpos],
-          sizeof(TextRow) * (editor.numrows - rpos));
+// rows from rpos on differ from the file, their matches are not counted
+// anymore and their lexer states are checked again
+static inline void ed_mark_dirty(int rpos) {
+  if (rpos < editor.dirty_row) editor.dirty_row = rpos;
+  if (rpos < editor.hl_rows) editor.hl_rows = rpos;
+  if (rpos / SEARCH_BLOCK_ROWS < editor.search.counted)
+    editor.search.counted = rpos / SEARCH_BLOCK_ROWS;
+}
+
+// make room for n rows at rpos, they take the first slots of the gap so
+// the rows after rpos are moved at most once. return the n slots, which
+// are contiguous and have to be filled by ed_row_init()
+static TextRow *ed_open_rows(int rpos, int n) {
+  // if rpos equals numrows and gap is at the end, nothing is moved
+  ed_grow_gap(n);
+  ed_move_gap(rpos);
+  ed_mark_dirty(rpos);
+  ed_journal(JR_INSERT_ROWS, rpos, n, NULL, 0);
+  ed_undo_log(JR_INSERT_ROWS, rpos, n, NULL, 0);
+  editor.gap += n;
+  editor.numrows += n;
+  ed_rcache_shift(rpos, n);
+  return &editor.row[rpos];
+}
 
-  // new row
-  editor.row[rpos].size = len;
-  editor.row[rpos].string = malloc(len + 1);
-  memcpy(editor.row[rpos].string, s, len);
-  editor.row[rpos].string[len] = '\0';
+// a new row holding a copy of s, rendered when it is shown
+static void ed_row_init(TextRow *row, const char *s, size_t len) {
+  row->size = row->rsize = 0;
+  row->cap = row->rcap = row->hlcap = 0;
+  row->hl_open = LEX_STALE;
+  row->store = 0;
+  row->string = NULL;
+  row->render = NULL;
+  row->hl = NULL;
+  ed_row_reserve(row, len);
+  memcpy(row->string, s, len);
+  row->size = len;
+  row->string[len] = '\0';
+  if (len) {
+    ed_journal(JR_INSERT, ed_row_index(row), 0, s, len);
+    ed_undo_log(JR_INSERT, ed_row_index(row), 0, s, len);
+  }
+}
 
-  editor.row[rpos].rsize = 0;
-  editor.row[rpos].render = NULL;
-  ed_render_row(&editor.row[rpos]);
+// insert a new row, just like ed_row_insert
+void ed_insert_row(int rpos, char *s, size_t len) {
+  if (rpos < 0 || rpos > editor.numrows) return;
+  ed_row_init(ed_open_rows(rpos, 1), s, len);
+}
 
-  editor.numrows++;
+// insert s[0, len) into pos
+void ed_row_insert_str(TextRow *row, int pos, const char *s, int len) {
+  if (pos < 0 || pos > row->size) pos = row->size;
+  ed_row_reserve(row, row->size + len);
+  ed_mark_dirty(ed_row_index(row));
+  row->hl_open = LEX_STALE;
+  ed_journal(JR_INSERT, ed_row_index(row), pos, s, len);
+  ed_undo_log(JR_INSERT, ed_row_index(row), pos, s, len);
+  memmove(&row->string[pos + len], &row->string[pos], row->size - pos + 1);
+  memcpy(&row->string[pos], s, len);
+  row->size += len;
+  ed_render_insert(row, pos, len);
 }
 
 // insert c into pos
 void ed_row_insert_char(TextRow *row, int pos, int c) {
-  if (pos < 0 || pos > row->size) pos = row->size;
-  row->string = realloc(row->string, row->size + 2);
-  memmove(&row->string[pos + 1], &row->string[pos], row->size - pos + 1);
-  row->size++;
-  row->string[pos] = c;
-  ed_render_row(row);
+  char ch = c;
+  ed_row_insert_str(row, pos, &ch, 1);
 }
 
 static inline void newline_before() { ed_insert_row(CURRENT_ROW, "", 0); }
 
 static inline void newline_after() {
-  TextRow *row = &editor.row[CURRENT_ROW];
-  ed_insert_row(editor.cy + 1, &row->string[CURRENT_COL],
-                row->size - CURRENT_COL);
-
-  // reget current row
-  row = &editor.row[CURRENT_ROW];
-  row->size = CURRENT_COL;
-  // cut strings after CURRENT_COL
-  row->string[row->size] = '\0';
-  ed_render_row(row);
+  TextRow *row = ed_row(CURRENT_ROW);
+  int pos = ed_cursor_pos();
+  if (pos > row->size) pos = row->size;
+  ed_insert_row(editor.cy + 1, &row->string[pos], row->size - pos);
+
+  // reget current row, cut strings after pos
+  ed_row_truncate(ed_row(CURRENT_ROW), pos);
 }
 
 static inline void newline_insert_mode() {
@@ -758,208 +2342,3933 @@ void ed_insert_newline(int after) {
   }
 }
 
+// delete len bytes at pos
+void ed_row_delete(TextRow *row, int pos, int len) {
+  if (pos < 0 || pos >= row->size || len <= 0) return;
+  if (len > row->size - pos) len = row->size - pos;
+  ed_row_own(row);
+  ed_mark_dirty(ed_row_index(row));
+  row->hl_open = LEX_STALE;
+  ed_journal(JR_DELETE, ed_row_index(row), pos, NULL, len);
+  ed_undo_log(JR_DELETE, ed_row_index(row), pos, &row->string[pos], len);
+  ed_render_delete(row, pos, len);
+  // move the rest backwards, with '\0'
+  memmove(&row->string[pos], &row->string[pos + len],
+          row->size - pos - len + 1);
+  row->size -= len;
+}
+
+// cut the row at pos
+void ed_row_truncate(TextRow *row, int pos) {
+  ed_row_delete(row, pos, row->size - pos);
+}
+
 void ed_row_delete_char(TextRow *row, int pos) {
-  if (pos < 0 || pos >= row->size) return;
-  // move a byte backwards
-  memmove(&row->string[pos], &row->string[pos + 1], row->size - pos);
-  // decrease size
-  row->size--;
-  ed_render_row(row);
+  ed_row_delete(row, pos, 1);
 }
 
 void ed_free_row(TextRow *row) {
-  free(row->render);
-  free(row->string);
+  if (row->rcap) ar_free(&editor.arena, row->render, row->rcap);
+  if (row->hlcap) ar_free(&editor.arena, row->hl, row->hlcap);
+  if (row->cap) ar_free(&editor.arena, row->string, row->cap);
+  if (row->store) ed_store_unref(row->store);
 }
 
 // join string s to row
 void ed_joinstr2row(TextRow *row, char *s, size_t len) {
-  row->string = realloc(row->string, row->size + len + 1);
-  memcpy(&row->string[row->size], s, len);
-  row->size += len;
-  row->string[row->size] = '\0';
-  ed_render_row(row);
+  ed_row_insert_str(row, row->size, s, len);
 }
 
-// delete a row at rpos
-// called from backspacing at the start of a line and
-// dd operation
-void ed_delete_row(int rpos) {
-  if (rpos < 0 || rpos >= editor.numrows) return;
-  ed_free_row(&editor.row[rpos]);
-  // move up
-  memmove(&editor.row[rpos], &editor.row[rpos + 1],
-          sizeof(TextRow) * (editor.numrows - rpos - 1));
-  editor.numrows--;
+// take n rows at rpos out of the file, they join the gap. only the rows
+// between them and the gap are moved, with one memmove. return the rows,
+// which stay in the gap until it moves again
+static TextRow *ed_cut_rows(int rpos, int n) {
+  ed_mark_dirty(rpos);
+  ed_journal(JR_DELETE_ROW, rpos, 0, NULL, n);
+  TextRow *rows;
+  if (editor.gap >= rpos + n) {
+    // the gap comes back to the end of the rows and grows over them
+    ed_move_gap(rpos + n);
+    rows = &editor.row[rpos];
+    editor.gap = rpos;
+  } else {
+    ed_move_gap(rpos);
+    rows = &editor.row[rpos + GAP_LEN];
+  }
+  editor.numrows -= n;
+  ed_rcache_shift(rpos, -n);
+  return rows;
 }
 
-/* edit ops, called from ed_progress_keyprogress() */
-
-void ed_insert_char(int c) {
-  // open or create empty file, create a new line
-  if (editor.numrows == editor.cy) {
-    ed_insert_row(editor.numrows, "", 0);
+// delete n rows at rpos at once
+// called from backspacing at the start of a line, J and d
+void ed_delete_rows(int rpos, int n) {
+  if (rpos < 0 || rpos >= editor.numrows || n <= 0) return;
+  if (n > editor.numrows - rpos) n = editor.numrows - rpos;
+  TextRow *rows = ed_cut_rows(rpos, n);
+  // kept by the undo log, or freed
+  if (!ed_undo_keep_rows(rpos, rows, n)) {
+    for (int i = 0; i < n; i++) ed_free_row(&rows[i]);
   }
-  // insert before cursor, just like vim
-  ed_row_insert_char(&editor.row[CURRENT_ROW], CURRENT_COL, c);
-  editor.cx++;
 }
 
-// delete char or row
-void ed_delete_char_row(int pos) {
-  if (editor.cy >= editor.numrows) return;
-  // empty
-  if (editor.cx == TEXT_START && editor.cy == 0) return;
+// delete a row at rpos
+void ed_delete_row(int rpos) { ed_delete_rows(rpos, 1); }
 
-  TextRow *row = &editor.row[CURRENT_ROW];
-  if (editor.cx > TEXT_START) {
-    // delete char on the cursor
-    ed_row_delete_char(row, pos);
-    editor.cx--;
-  } else {
-    // delete this row, join its string to previous line
-    // editor.cx = MAX_CX(editor.row[CURRENT_ROW - 1]) + 1;
-    editor.cx = editor.row[CURRENT_ROW - 1].size + TEXT_START;
-    ed_joinstr2row(&editor.row[CURRENT_ROW - 1], row->string, row->size);
-    ed_delete_row(CURRENT_ROW);
-    editor.cy--;
+// move n rows at rpos out of the file into rows, for the undo log
+static void ed_take_rows(int rpos, int n, TextRow *rows) {
+  memcpy(rows, ed_cut_rows(rpos, n), sizeof(TextRow) * n);
+  for (int i = 0; i < n; i++) {
+    ed_render_free(&rows[i]);
+    ed_hl_free(&rows[i]);
   }
 }
 
-/* mode */
-
-void to_normal_mode() {
-  int max_size = MAX_CX(editor.row[CURRENT_ROW]);
-  // snap cursor at the last char
-  if (editor.cx > max_size) editor.cx = max_size;
-  editor.mode = NORMAL_MODE;
+// put n rows taken by ed_take_rows() back at rpos
+static void ed_put_rows(int rpos, int n, const TextRow *rows) {
+  TextRow *slots = ed_open_rows(rpos, n);
+  memcpy(slots, rows, sizeof(TextRow) * n);
+  for (int i = 0; i < n; i++) {
+    if (slots[i].size)
+      ed_journal(JR_INSERT, rpos + i, 0, slots[i].string, slots[i].size);
+  }
 }
 
-void to_insert_mode() { editor.mode = INSERT_MODE; }
+/* syntax */
 
-/* file I/O */
+static const char *c_exts[] = {".c",  ".h",   ".cc",  ".cpp", ".cxx",
+                               ".hh", ".hpp", ".hxx", NULL};
+static const char *c_keywords[] = {
+    "auto", "break", "case", "catch", "class", "const", "constexpr",
+    "continue", "default", "delete", "do", "else", "enum", "extern",
+    "false", "for", "goto", "if", "inline", "namespace", "new", "nullptr",
+    "operator", "private", "protected", "public", "register", "restrict",
+    "return", "sizeof", "static", "struct", "switch", "template", "this",
+    "throw", "true", "try", "typedef", "union", "using", "virtual",
+    "volatile", "while", "NULL",
 
-void ed_open(const char *filename) {
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+    "bool|", "char|", "double|", "float|", "int|", "long|", "short|",
+    "signed|", "unsigned|", "void|", "size_t|", "ssize_t|", "int8_t|",
+    "int16_t|", "int32_t|", "int64_t|", "uint8_t|", "uint16_t|",
+    "uint32_t|", "uint64_t|", NULL};
 
-  free(editor.filename);
-  editor.filename = strdup(filename);
+static struct syntax syntaxes[] = {
+    {"c", c_exts, c_keywords},
+};
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  // read line by line
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    // remove \n and \r
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    ed_insert_row(editor.numrows, line, linelen);
-  }
+// escape codes of the highlight classes
+static const int hl_colors[] = {39, 36, 33, 32, 35, 31, 34};
 
-  char numbuf[10];
-  editor.rownum_width = snprintf(numbuf, 10, "%d", editor.numrows);
+// the syntax of a file, NULL if it has none
+static struct syntax *ed_syntax_for(const char *filename) {
+  int len = strlen(filename);
+  for (size_t i = 0; i < sizeof(syntaxes) / sizeof(syntaxes[0]); i++) {
+    for (const char **ext = syntaxes[i].exts; *ext; ext++) {
+      int elen = strlen(*ext);
+      if (len > elen && strcmp(filename + len - elen, *ext) == 0)
+        return &syntaxes[i];
+    }
+  }
+  return NULL;
+}
 
-  // move cursor after line number
-  editor.cy = 0;
-  editor.cx = editor.prev_cx = TEXT_START;
+static inline int lex_is_word(int c) { return isalnum(c) || c == '_'; }
 
-  free(line);
-  fclose(fp);
-  editor.file_opened = 1;
+// the next n bytes are of class hl
+static void lex_put(struct lexer *lx, int n, int hl) {
+  if (lx->hl == NULL) {
+    lx->i += n;
+    return;
+  }
+  for (int end = lx->i + n; lx->i < end; lx->i++) {
+    int width = lx->s[lx->i] == '\t' ? TAB_SIZE : 1;
+    memset(&lx->hl[lx->rx], hl, width);
+    lx->rx += width;
+  }
 }
 
-char *ed_rows2str(int *buflen) {
-  int totallen = 0;
-  for (int i = 0; i < editor.numrows; i++) {
-    totallen += editor.row[i].size + 1;
+// the rest of a comment, return the state at the end of the row
+static int lex_comment(struct lexer *lx) {
+  const char *end = memmem(lx->s + lx->i, lx->len - lx->i, "*/", 2);
+  if (end == NULL) {
+    lex_put(lx, lx->len - lx->i, HL_COMMENT);
+    return LEX_COMMENT;
   }
-  *buflen = totallen;
+  lex_put(lx, end + 2 - (lx->s + lx->i), HL_COMMENT);
+  return LEX_CODE;
+}
 
-  char *buf = malloc(totallen);
-  char *p = buf;
+// the rest of a string or char closed by quote, it goes on on the next
+// row after a \ at the end of this one
+static int lex_quoted(struct lexer *lx, int quote, int state) {
+  int j = lx->i;
+  while (j < lx->len) {
+    if (lx->s[j] == '\\') {
+      j += 2;
+    } else if (lx->s[j++] == quote) {
+      lex_put(lx, j - lx->i, HL_STRING);
+      return LEX_CODE;
+    }
+  }
+  int open = j > lx->len;
+  lex_put(lx, lx->len - lx->i, HL_STRING);
+  return open ? state : LEX_CODE;
+}
 
-  for (int i = 0; i < editor.numrows; i++) {
-    memcpy(p, editor.row[i].string, editor.row[i].size);
-    p += editor.row[i].size;
-    // append \n
-    *p = '\n';
-    // move after to \n, just a new line
-    p++;
+// class of the word s[0, len)
+static int lex_keyword(const char *s, int len) {
+  for (const char **k = editor.syntax->keywords; *k; k++) {
+    int klen = strlen(*k);
+    int type = (*k)[klen - 1] == '|';
+    if (klen - type == len && memcmp(*k, s, len) == 0)
+      return type ? HL_KEYWORD2 : HL_KEYWORD1;
   }
-  return buf;
+  return HL_NORMAL;
 }
 
-void ed_save() {
-  if (!editor.file_opened) return;
+// lex s[0, len) from state, return the state at its end. only comments
+// and strings go on past a row, the classes of the rest are only worked
+// out if hl is set
+static int ed_lex(const char *s, int len, int state, unsigned char *hl) {
+  struct lexer lx = {s, len, 0, hl, 0};
+  if (state == LEX_COMMENT) {
+    state = lex_comment(&lx);
+  } else if (state != LEX_CODE) {
+    state = lex_quoted(&lx, state == LEX_STRING ? '"' : '\'', state);
+  }
+  int lead = lx.i;
+  while (lead < len && isspace((unsigned char)s[lead])) lead++;
 
-  int len;
-  char *buf = ed_rows2str(&len);
+  while (lx.i < len && state == LEX_CODE) {
+    if (hl == NULL) {
+      // to the next byte that may start a comment or a string
+      while (lx.i < len && s[lx.i] != '/' && s[lx.i] != '"' &&
+             s[lx.i] != '\'')
+        lx.i++;
+      if (lx.i == len) break;
+    }
+    int c = (unsigned char)s[lx.i];
+    int next = lx.i + 1 < len ? s[lx.i + 1] : '\0';
+    if (c == '/' && next == '/') {
+      lex_put(&lx, len - lx.i, HL_COMMENT);
+    } else if (c == '/' && next == '*') {
+      lex_put(&lx, 2, HL_COMMENT);
+      state = lex_comment(&lx);
+    } else if (c == '"' || c == '\'') {
+      lex_put(&lx, 1, HL_STRING);
+      state = lex_quoted(&lx, c, c == '"' ? LEX_STRING : LEX_CHAR);
+    } else if (hl == NULL) {
+      lx.i++;
+    } else if (c == '#' && lx.i == lead) {
+      // the directive
+      int j = lx.i + 1;
+      while (j < len && isspace((unsigned char)s[j])) j++;
+      while (j < len && lex_is_word((unsigned char)s[j])) j++;
+      lex_put(&lx, j - lx.i, HL_PREPROC);
+    } else if (lex_is_word(c) &&
+               (lx.i == 0 || !lex_is_word((unsigned char)s[lx.i - 1]))) {
+      int j = lx.i;
+      while (j < len && (lex_is_word((unsigned char)s[j]) ||
+                         (isdigit(c) && s[j] == '.')))
+        j++;
+      lex_put(&lx, j - lx.i,
+              isdigit(c) ? HL_NUMBER : lex_keyword(s + lx.i, j - lx.i));
+    } else {
+      lex_put(&lx, 1, HL_NORMAL);
+    }
+  }
+  return state;
+}
 
-  int fd = open(editor.filename, O_RDWR | O_CREAT, 0644);
-  // set file size
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        ed_set_commandmsg("%dL, %dC written", editor.numrows, len);
-        return;
+// lex the row at rpos from state open, keeping the classes if hl is set.
+// rows after it are lexed again if it ends in another state than before
+static void ed_hl_row(int rpos, int open, int hl) {
+  TextRow *row = ed_row(rpos);
+  if (hl) {
+    if (row->rsize + 1 > row->hlcap) {
+      if (row->hlcap) {
+        ar_free(&editor.arena, row->hl, row->hlcap);
+      } else {
+        ed_rcache_add(rpos);
       }
+      row->hl = ar_alloc(&editor.arena, row->rsize + 1, &row->hlcap);
     }
-    close(fd);
+  } else {
+    ed_hl_free(row);
   }
-  free(buf);
-  ed_set_commandmsg("can't save! I/O error: %s", strerror(errno));
+  int close = ed_lex(row->string, row->size, open, row->hl);
+  if (row->hl_open != LEX_STALE && close != row->hl_close &&
+      editor.hl_rows > rpos + 1)
+    editor.hl_rows = rpos + 1;
+  row->hl_open = open;
+  row->hl_close = close;
 }
-/* init */
 
-void init_editor() {
-  enable_raw_mode();
-
-  editor.cx = editor.cy = 0;
-  editor.rx = 0;
-  editor.mode = NORMAL_MODE;
-  editor.numrows = 0;
-  editor.row = NULL;
-  editor.row_offset = editor.col_offset = 0;
-  editor.filename = NULL;
-  editor.file_opened = 0;
-  editor.rownum_width = 0;
-
-  editor.commandmsg[0] = '\0';
-  editor.commandmsg_time = 0;
+// lexer state at the start of the row at rpos
+static inline int ed_hl_open(int rpos) {
+  return rpos ? ed_row(rpos - 1)->hl_close : LEX_CODE;
+}
 
-  if (get_winsize(&editor.winrows, &editor.wincols) == -1) die("get_winsize");
+// highlight of the row at rpos, which has to be rendered. the rows before
+// it are lexed first if they changed or follow a row that now ends in
+// another state, only for their states. rows after the one lexed last
+// are not lexed again once a row ends in the state it ended in before
+static unsigned char *ed_row_hl(int rpos) {
+  while (editor.hl_rows < rpos) {
+    int r = editor.hl_rows;
+    if (ed_row(r)->hl_open != ed_hl_open(r)) ed_hl_row(r, ed_hl_open(r), 0);
+    editor.hl_rows = r + 1;
+  }
+  TextRow *row = ed_row(rpos);
+  if (row->hl_open != ed_hl_open(rpos) || row->hl == NULL)
+    ed_hl_row(rpos, ed_hl_open(rpos), 1);
+  if (editor.hl_rows == rpos) editor.hl_rows = rpos + 1;
+  return row->hl;
+}
 
-  ed_set_commandmsg("type <CTRL-Q> to quit");
+// switch the color to the one of class hl
+static inline void ed_draw_color(struct abuf *ab, int hl) {
+  char buf[16];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%dm", hl_colors[hl]);
+  ab_append(ab, buf, len);
 }
 
-static inline void init_rowcol() {
-  // last 2 row draw as status bar
-  editor.winrows -= 2;
-  // first some cols display as line number
-  editor.wincols -= TEXT_START;
+// append render columns [from, to) of the row, switching colors only
+// where the class changes. hl may be NULL for none
+static void ed_draw_span(struct abuf *ab, TextRow *row,
+                         const unsigned char *hl, int from, int to) {
+  if (from >= to) return;
+  if (hl == NULL) {
+    ab_append(ab, row->render + from, to - from);
+    return;
+  }
+  int cur = HL_NORMAL;
+  int start = from;
+  for (int i = from; i < to; i++) {
+    if (hl[i] == cur) continue;
+    ab_append(ab, row->render + start, i - start);
+    cur = hl[i];
+    ed_draw_color(ab, cur);
+    start = i;
+  }
+  ab_append(ab, row->render + start, to - start);
+  if (cur != HL_NORMAL) ed_draw_color(ab, HL_NORMAL);
 }
 
-int main(int argc, char const *argv[]) {
-  init_editor();
+/* edit ops, called from ed_progress_keyprogress() */
 
-  if (argc == 1) {
-    // show welcome message
-  } else if (argc == 2) {
-    ed_open(argv[1]);
-  } else {
-    println("Usage: %s <filename>", argv[0]);
-    exit(0);
+void ed_insert_char(int c) {
+  // open or create empty file, create a new line
+  if (editor.numrows == editor.cy) {
+    ed_insert_row(editor.numrows, "", 0);
+  }
+  // insert before cursor, just like vim
+  int pos = ed_cursor_pos();
+  ed_row_insert_char(ed_row(CURRENT_ROW), pos, c);
+  ed_cursor_to(CURRENT_ROW, pos + 1);
+}
+
+// end of the line starting at s, a line ends with \r, \n or \r\n
+static const char *ed_line_end(const char *s, const char *end) {
+  while (s < end && *s != '\r' && *s != '\n') s++;
+  return s;
+}
+
+static const char *ed_next_line(const char *s, const char *end) {
+  if (s < end && *s == '\r') s++;
+  if (s < end && *s == '\n') s++;
+  return s;
+}
+
+// insert text before the cursor as if it was typed, but in one go: the
+// first line goes into the current row, the lines after it are inserted
+// as new rows at once and the rest of the current row is joined to the
+// last one
+void ed_insert_text(const char *s, int len) {
+  if (len <= 0) return;
+  if (editor.numrows == editor.cy) {
+    ed_insert_row(editor.numrows, "", 0);
+  }
+  const char *end = s + len;
+  int lines = 0;
+  for (const char *p = ed_line_end(s, end); p < end;
+       p = ed_line_end(ed_next_line(p, end), end)) {
+    lines++;
+  }
+
+  TextRow *row = ed_row(CURRENT_ROW);
+  int pos = ed_cursor_pos();
+  const char *eol = ed_line_end(s, end);
+  if (lines == 0) {
+    ed_row_insert_str(row, pos, s, len);
+    ed_cursor_to(CURRENT_ROW, pos + len);
+    return;
+  }
+
+  TextRow *rows = ed_open_rows(CURRENT_ROW + 1, lines);
+  const char *line = ed_next_line(eol, end);
+  for (int i = 0; i < lines; i++) {
+    const char *next = ed_line_end(line, end);
+    ed_row_init(&rows[i], line, next - line);
+    line = ed_next_line(next, end);
+  }
+  // rows may have moved when the gap grew
+  row = ed_row(CURRENT_ROW);
+  TextRow *last = &rows[lines - 1];
+  int lastlen = last->size;
+  ed_row_insert_str(last, lastlen, &row->string[pos], row->size - pos);
+
+  // cut the current row at pos and append the first line
+  ed_row_truncate(row, pos);
+  ed_row_insert_str(row, pos, s, eol - s);
+
+  ed_update_rownum_width();
+  ed_cursor_to(CURRENT_ROW + lines, lastlen);
+}
+
+// text pasted into the terminal, inserted at the cursor in any mode
+void ed_paste() {
+  struct abuf ab = ABUF_INIT;
+  ab.b = malloc(ab.cap);
+  ed_read_paste(&ab);
+  if (editor.file_opened) ed_insert_text(ab.b, ab.len);
+  ab_free(&ab);
+  if (editor.mode == NORMAL_MODE) to_normal_mode();
+}
+
+// delete char or row
+void ed_delete_char_row(int pos) {
+  if (editor.cy >= editor.numrows) return;
+  // empty
+  if (editor.cx == TEXT_START && editor.cy == 0) return;
+
+  TextRow *row = ed_row(CURRENT_ROW);
+  if (editor.cx > TEXT_START) {
+    // delete char on the cursor
+    ed_row_delete_char(row, pos);
+    ed_cursor_to(CURRENT_ROW, pos);
+  } else {
+    // delete this row, join its string to previous line
+    int size = ed_row(CURRENT_ROW - 1)->size;
+    ed_joinstr2row(ed_row(CURRENT_ROW - 1), row->string, row->size);
+    ed_delete_row(CURRENT_ROW);
+    ed_cursor_to(CURRENT_ROW - 1, size);
+  }
+}
+
+/* undo */
+
+// account for memory taken or given back by an op
+static void ed_undo_resize(struct undo_op *u, size_t bytes) {
+  editor.undo.bytes += bytes - u->bytes;
+  u->bytes = bytes;
+}
+
+static void ed_undo_free_op(struct undo_op *u) {
+  free(u->text);
+  if (u->rows) {
+    for (int i = 0; i < u->len; i++) ed_free_row(&u->rows[i]);
+    free(u->rows);
+  }
+  editor.undo.bytes -= u->bytes;
+}
+
+static void ed_undo_free_change(struct undo_change *ch) {
+  for (int i = 0; i < ch->nops; i++) ed_undo_free_op(&ch->ops[i]);
+  free(ch->ops);
+}
+
+// drop the oldest changes while the log holds more than its limit,
+// keeping the ones from keep on
+static void ed_undo_trim(int keep) {
+  struct undo *ud = &editor.undo;
+  int n = 0;
+  while (n < keep && ud->bytes > ud->limit)
+    ed_undo_free_change(&ud->changes[n++]);
+  if (n == 0) return;
+  memmove(ud->changes, &ud->changes[n],
+          sizeof(struct undo_change) * (ud->nchanges - n));
+  ud->nchanges -= n;
+  ud->done -= n;
+}
+
+// the change edits are recorded into, NULL while they are not recorded
+static struct undo_change *ed_undo_change() {
+  struct undo *ud = &editor.undo;
+  if (ud->applying || editor.journal.replaying || !editor.file_opened)
+    return NULL;
+  if (ud->seal || ud->done == 0) {
+    // what was undone can't be redone after a new change
+    for (int i = ud->done; i < ud->nchanges; i++)
+      ed_undo_free_change(&ud->changes[i]);
+    ud->nchanges = ud->done;
+    if (ud->nchanges == ud->cap) {
+      ud->cap = ud->cap ? ud->cap * 2 : 64;
+      ud->changes = realloc(ud->changes, sizeof(struct undo_change) * ud->cap);
+      if (ud->changes == NULL) die("realloc");
+    }
+    struct undo_change *ch = &ud->changes[ud->nchanges++];
+    ch->ops = NULL;
+    ch->nops = ch->cap = 0;
+    ch->cy = editor.cy;
+    ch->pos = ed_cursor_pos();
+    ud->done = ud->nchanges;
+    ud->seal = 0;
+  }
+  return &ud->changes[ud->done - 1];
+}
+
+static struct undo_op *ed_undo_push(struct undo_change *ch, int op, int row,
+                                    int pos) {
+  if (ch->nops == ch->cap) {
+    ch->cap = ch->cap ? ch->cap * 2 : 4;
+    ch->ops = realloc(ch->ops, sizeof(struct undo_op) * ch->cap);
+    if (ch->ops == NULL) die("realloc");
+  }
+  struct undo_op *u = &ch->ops[ch->nops++];
+  u->op = op;
+  u->row = row;
+  u->pos = pos;
+  u->len = u->cap = 0;
+  u->text = NULL;
+  u->rows = NULL;
+  u->bytes = 0;
+  ed_undo_resize(u, sizeof(struct undo_op));
+  return u;
+}
+
+// put s[0, len) into the op's text at
+static void ed_undo_text(struct undo_op *u, int at, const char *s, int len) {
+  if (u->len + len > u->cap) {
+    int cap = u->cap ? u->cap : 16;
+    while (cap < u->len + len) cap *= 2;
+    u->text = realloc(u->text, cap);
+    if (u->text == NULL) die("realloc");
+    ed_undo_resize(u, u->bytes + cap - u->cap);
+    u->cap = cap;
+  }
+  memmove(&u->text[at + len], &u->text[at], u->len - at);
+  memcpy(&u->text[at], s, len);
+  u->len += len;
+}
+
+// start a new change with the next edit, called before each normal mode
+// command
+void ed_undo_seal() { editor.undo.seal = 1; }
+
+// record a row op, called from the row ops like ed_journal().
+// edits next to the last one are merged into it, typing a word or
+// backspacing over it takes one op
+void ed_undo_log(int op, int row, int pos, const char *s, int len) {
+  if (op == JR_INSERT_ROWS ? pos == 0 : len == 0) return;
+  struct undo_change *ch = ed_undo_change();
+  if (ch == NULL) return;
+  struct undo_op *last = ch->nops ? &ch->ops[ch->nops - 1] : NULL;
+  if (last && last->op == JR_INSERT_ROWS && last->rows == NULL &&
+      row >= last->row && row <= last->row + last->len) {
+    // new rows get their text right after they are opened. undoing the
+    // op takes the rows with their text, which it puts back when redone
+    if (op == JR_INSERT && row < last->row + last->len) return;
+    if (op == JR_INSERT_ROWS) {
+      last->len += pos;
+      return;
+    }
+  }
+  if (op == JR_INSERT_ROWS) {
+    ed_undo_push(ch, op, row, 0)->len = pos;
+    return;
+  }
+
+  int merge = last && last->op == op && last->row == row;
+  if (merge && op == JR_INSERT && last->pos + last->len == pos) {
+    ed_undo_text(last, last->len, s, len);
+  } else if (merge && op == JR_DELETE && last->pos == pos) {  // DEL, x
+    ed_undo_text(last, last->len, s, len);
+  } else if (merge && op == JR_DELETE && pos + len == last->pos) {
+    ed_undo_text(last, 0, s, len);  // backspace
+    last->pos = pos;
+  } else {
+    ed_undo_text(ed_undo_push(ch, op, row, pos), 0, s, len);
+  }
+  ed_undo_trim(editor.undo.done - 1);
+}
+
+// memory a row in the log holds. a row viewing a store is charged for
+// its string, which the store only frees with the rest of the yank
+static size_t ed_undo_row_bytes(TextRow *row) {
+  return row->store ? (size_t)row->size + 1 : (size_t)row->cap;
+}
+
+// take n rows deleted at rpos into the log instead of copying their text,
+// return 0 if they are not recorded and have to be freed
+int ed_undo_keep_rows(int rpos, TextRow *rows, int n) {
+  struct undo_change *ch = ed_undo_change();
+  if (ch == NULL) return 0;
+  struct undo_op *u = ch->nops ? &ch->ops[ch->nops - 1] : NULL;
+  // rows deleted one after another at the same place
+  if (u == NULL || u->op != JR_DELETE_ROW || u->row != rpos)
+    u = ed_undo_push(ch, JR_DELETE_ROW, rpos, 0);
+  if (u->len + n > u->cap) {
+    int cap = u->cap ? u->cap : 16;
+    while (cap < u->len + n) cap *= 2;
+    u->rows = realloc(u->rows, sizeof(TextRow) * cap);
+    if (u->rows == NULL) die("realloc");
+    ed_undo_resize(u, u->bytes + sizeof(TextRow) * (cap - u->cap));
+    u->cap = cap;
+  }
+  size_t bytes = 0;
+  for (int i = 0; i < n; i++) {
+    ed_render_free(&rows[i]);
+    ed_hl_free(&rows[i]);
+    bytes += ed_undo_row_bytes(&rows[i]);
+  }
+  memcpy(&u->rows[u->len], rows, sizeof(TextRow) * n);
+  u->len += n;
+  ed_undo_resize(u, u->bytes + bytes);
+  ed_undo_trim(editor.undo.done - 1);
+  return 1;
+}
+
+// undo or redo an op through the row ops
+static void ed_undo_apply(struct undo_op *u, int undo) {
+  int insert = (u->op == JR_INSERT || u->op == JR_INSERT_ROWS) != undo;
+  if (u->op == JR_INSERT || u->op == JR_DELETE) {
+    if (insert) {
+      ed_row_insert_str(ed_row(u->row), u->pos, u->text, u->len);
+    } else {
+      ed_row_delete(ed_row(u->row), u->pos, u->len);
+    }
+    return;
+  }
+
+  size_t bytes = sizeof(struct undo_op);
+  if (insert) {
+    ed_put_rows(u->row, u->len, u->rows);
+    free(u->rows);
+    u->rows = NULL;
+    u->cap = 0;
+  } else {
+    u->rows = malloc(sizeof(TextRow) * u->len);
+    if (u->rows == NULL) die("malloc");
+    u->cap = u->len;
+    ed_take_rows(u->row, u->len, u->rows);
+    bytes += sizeof(TextRow) * u->len;
+    for (int i = 0; i < u->len; i++) bytes += ed_undo_row_bytes(&u->rows[i]);
+  }
+  ed_undo_resize(u, bytes);
+}
+
+// put the cursor on byte pos of row cy after an undo or redo
+static void ed_undo_cursor(int cy, int pos) {
+  if (cy >= editor.numrows) cy = editor.numrows - 1;
+  if (cy >= 0) {
+    ed_cursor_to(cy, pos);
+  } else {
+    editor.cy = 0;
+    editor.cx = TEXT_START;
+  }
+  if (editor.numrows) to_normal_mode();
+  editor.prev_cx = editor.cx;
+}
+
+// u, undo the last change not undone yet
+void ed_undo() {
+  struct undo *ud = &editor.undo;
+  if (ud->done == 0) {
+    ed_set_commandmsg("Already at oldest change");
+    return;
+  }
+  struct undo_change *ch = &ud->changes[--ud->done];
+  ud->applying = 1;
+  for (int i = ch->nops - 1; i >= 0; i--) ed_undo_apply(&ch->ops[i], 1);
+  ud->applying = 0;
+  ud->seal = 1;
+  ed_update_rownum_width();
+  ed_undo_cursor(ch->cy, ch->pos);
+  ed_undo_trim(ud->done);
+}
+
+// CTRL-R, redo the last change undone
+void ed_redo() {
+  struct undo *ud = &editor.undo;
+  if (ud->done == ud->nchanges) {
+    ed_set_commandmsg("Already at newest change");
+    return;
+  }
+  struct undo_change *ch = &ud->changes[ud->done++];
+  ud->applying = 1;
+  for (int i = 0; i < ch->nops; i++) ed_undo_apply(&ch->ops[i], 0);
+  ud->applying = 0;
+  ud->seal = 1;
+  ed_update_rownum_width();
+  struct undo_op *first = &ch->ops[0];
+  ed_undo_cursor(first->row, first->op == JR_INSERT || first->op == JR_DELETE
+                                 ? first->pos
+                                 : 0);
+  ed_undo_trim(ud->done - 1);
+}
+
+// rows in the log pointing into the map from s on get their own copy,
+// before a save overwrites that part of the file
+void ed_undo_own(const char *s) {
+  struct undo *ud = &editor.undo;
+  for (int c = 0; c < ud->nchanges; c++) {
+    struct undo_change *ch = &ud->changes[c];
+    for (int i = 0; i < ch->nops; i++) {
+      struct undo_op *u = &ch->ops[i];
+      for (int r = 0; u->rows && r < u->len; r++) {
+        TextRow *row = &u->rows[r];
+        if (row->cap || row->store || row->string < s) continue;
+        ed_row_own(row);
+        ed_undo_resize(u, u->bytes + row->cap);
+      }
+    }
+  }
+}
+
+// forget all changes, before the rows they hold are freed with the file
+void ed_undo_clear() {
+  struct undo *ud = &editor.undo;
+  for (int i = 0; i < ud->nchanges; i++) ed_undo_free_change(&ud->changes[i]);
+  free(ud->changes);
+  ud->changes = NULL;
+  ud->nchanges = ud->cap = ud->done = 0;
+  ud->bytes = 0;
+  ud->seal = 0;
+}
+
+/* regex */
+
+// patterns are vim's magic regexes: . [] * ^ $ \+ \= \? \| \( \) \< \>
+// and \d \s \w \t \e. they are matched without backtracking, and a match
+// never spans a line end. the dfas never find an empty match, :s looks
+// for those on its own with rx_empty_at()
+
+static inline int rx_is_eol(int c) { return c == '\n' || c == '\r'; }
+
+// c is 256 at the end of the text
+static inline int rx_kind(int c) {
+  if (c == 256 || rx_is_eol(c)) return RX_KIND_EOL;
+  return c == '_' || isalnum(c) || c >= 0x80 ? RX_KIND_WORD : RX_KIND_OTHER;
+}
+
+static inline void rx_set_add(unsigned char *set, int lo, int hi) {
+  for (int c = lo; c <= hi; c++) set[c >> 3] |= 1 << (c & 7);
+}
+
+static int rx_node(struct rx_compiler *rc, int type, int a, int b) {
+  if (rc->nnodes == rc->nodecap) {
+    rc->nodecap = rc->nodecap ? rc->nodecap * 2 : 16;
+    rc->nodes = realloc(rc->nodes, sizeof(struct rx_node) * rc->nodecap);
+    if (rc->nodes == NULL) die("realloc");
+  }
+  struct rx_node *node = &rc->nodes[rc->nnodes];
+  node->type = type;
+  node->set = -1;
+  node->a = a;
+  node->b = b;
+  return rc->nnodes++;
+}
+
+// a RX_SET node, *set is its empty set to fill
+static int rx_set_node(struct rx_compiler *rc, unsigned char **set) {
+  struct regex *re = rc->re;
+  if (re->nsets == rc->setcap) {
+    rc->setcap = rc->setcap ? rc->setcap * 2 : 8;
+    re->sets = realloc(re->sets, sizeof(*re->sets) * rc->setcap);
+    if (re->sets == NULL) die("realloc");
+  }
+  int n = rx_node(rc, RX_SET, -1, -1);
+  rc->nodes[n].set = re->nsets;
+  *set = re->sets[re->nsets++];
+  memset(*set, 0, sizeof(*re->sets));
+  return n;
+}
+
+static int rx_byte(struct rx_compiler *rc, int c) {
+  unsigned char *set;
+  int n = rx_set_node(rc, &set);
+  rx_set_add(set, c, c);
+  if (rc->plain) {
+    char ch = c;
+    ab_append(&rc->literal, &ch, 1);
+  }
+  return n;
+}
+
+// . and the other sets, which never take a line end
+static int rx_bytes(struct rx_compiler *rc, const unsigned char *bytes,
+                    int negate) {
+  unsigned char *set;
+  int n = rx_set_node(rc, &set);
+  for (int i = 0; i < 32; i++) set[i] = negate ? ~bytes[i] : bytes[i];
+  set['\n' >> 3] &= ~(1 << ('\n' & 7));
+  set['\r' >> 3] &= ~(1 << ('\r' & 7));
+  rc->plain = 0;
+  return n;
+}
+
+// \d \s \w, or \D \S \W for the bytes not in them. -1 if c is none of
+// them
+static int rx_class(struct rx_compiler *rc, int c) {
+  unsigned char bytes[32] = {0};
+  int lower = tolower(c);
+  for (int b = 0; b < 256; b++) {
+    int in = 0;
+    if (lower == 'd') {
+      in = isdigit(b);
+    } else if (lower == 's') {
+      in = b == ' ' || b == '\t' || b == '\v' || b == '\f';
+    } else if (lower == 'w') {
+      in = isalnum(b) || b == '_';
+    } else {
+      return -1;
+    }
+    if (in) rx_set_add(bytes, b, b);
+  }
+  return rx_bytes(rc, bytes, c != lower);
+}
+
+// a byte inside [], which may be escaped
+static int rx_bracket_byte(struct rx_compiler *rc) {
+  int c = (unsigned char)*rc->p++;
+  if (c == '\\' && rc->p < rc->end) {
+    c = (unsigned char)*rc->p++;
+    if (c == 't') c = '\t';
+    if (c == 'e') c = '\x1b';
+  }
+  return c;
+}
+
+// [] after its [, -1 if there is no ] and the [ is a plain byte
+static int rx_bracket(struct rx_compiler *rc) {
+  const char *start = rc->p;
+  unsigned char bytes[32] = {0};
+  int negate = rc->p < rc->end && *rc->p == '^';
+  if (negate) rc->p++;
+  if (rc->p < rc->end && *rc->p == ']') {
+    rx_set_add(bytes, ']', ']');
+    rc->p++;
+  }
+  while (rc->p < rc->end && *rc->p != ']') {
+    int lo = rx_bracket_byte(rc);
+    int hi = lo;
+    if (rc->end - rc->p >= 2 && *rc->p == '-' && rc->p[1] != ']') {
+      rc->p++;
+      hi = rx_bracket_byte(rc);
+    }
+    rx_set_add(bytes, lo, hi);
+  }
+  if (rc->p == rc->end) {
+    rc->p = start;
+    return -1;
+  }
+  rc->p++;
+  return rx_bytes(rc, bytes, negate);
+}
+
+static inline int rx_at(struct rx_compiler *rc, const char *s) {
+  return rc->end - rc->p >= 2 && rc->p[0] == s[0] && rc->p[1] == s[1];
+}
+
+// $ is an assertion only where a branch ends
+static inline int rx_branch_end(struct rx_compiler *rc) {
+  return rc->p == rc->end || rx_at(rc, "\\|") || rx_at(rc, "\\)");
+}
+
+static int rx_assert(struct rx_compiler *rc, int type) {
+  rc->plain = 0;
+  return rx_node(rc, type, -1, -1);
+}
+
+static int rx_alt(struct rx_compiler *rc);
+
+// ^ is an assertion only where a branch starts, and * a plain byte
+static int rx_atom(struct rx_compiler *rc, int first) {
+  int c = (unsigned char)*rc->p++;
+  if (c == '^' && first) return rx_assert(rc, RX_BOL);
+  if (c == '$' && rx_branch_end(rc)) return rx_assert(rc, RX_EOL);
+  if (c == '.') {
+    unsigned char none[32] = {0};
+    return rx_bytes(rc, none, 1);
+  }
+  if (c == '[') {
+    int n = rx_bracket(rc);
+    return n >= 0 ? n : rx_byte(rc, c);
+  }
+  if (c != '\\' || rc->p == rc->end) return rx_byte(rc, c);
+
+  c = (unsigned char)*rc->p++;
+  switch (c) {
+    case '(': {
+      rc->plain = 0;
+      int n = rx_alt(rc);
+      if (rx_at(rc, "\\)")) {
+        rc->p += 2;
+      } else {
+        rc->err = "E54: Unmatched \\(";
+      }
+      return n;
+    }
+    case '<':
+      return rx_assert(rc, RX_BOW);
+    case '>':
+      return rx_assert(rc, RX_EOW);
+    case 't':
+      return rx_byte(rc, '\t');
+    case 'e':
+      return rx_byte(rc, '\x1b');
+  }
+  int n = rx_class(rc, c);
+  return n >= 0 ? n : rx_byte(rc, c);
+}
+
+static int rx_piece(struct rx_compiler *rc, int first) {
+  int n = rx_atom(rc, first);
+  while (rc->p < rc->end) {
+    int type;
+    if (*rc->p == '*') {
+      type = RX_STAR;
+      rc->p++;
+    } else if (rx_at(rc, "\\+")) {
+      type = RX_PLUS;
+      rc->p += 2;
+    } else if (rx_at(rc, "\\=") || rx_at(rc, "\\?")) {
+      type = RX_QUEST;
+      rc->p += 2;
+    } else {
+      break;
+    }
+    rc->plain = 0;
+    n = rx_node(rc, type, n, -1);
+  }
+  return n;
+}
+
+static int rx_cat(struct rx_compiler *rc) {
+  int n = -1;
+  int first = 1;
+  while (!rx_branch_end(rc)) {
+    int a = rx_piece(rc, first);
+    n = n < 0 ? a : rx_node(rc, RX_CAT, n, a);
+    first = 0;
+  }
+  return n < 0 ? rx_node(rc, RX_EMPTY, -1, -1) : n;
+}
+
+static int rx_alt(struct rx_compiler *rc) {
+  int n = rx_cat(rc);
+  while (rx_at(rc, "\\|")) {
+    rc->p += 2;
+    rc->plain = 0;
+    int b = rx_cat(rc);
+    n = rx_node(rc, RX_ALT, n, b);
+  }
+  return n;
+}
+
+static int rx_inst(struct rx_compiler *rc, int op, int x, int y) {
+  if (rc->len == rc->cap) {
+    rc->cap = rc->cap ? rc->cap * 2 : 16;
+    rc->code = realloc(rc->code, sizeof(struct nfa_inst) * rc->cap);
+    if (rc->code == NULL) die("realloc");
+  }
+  struct nfa_inst *in = &rc->code[rc->len];
+  in->op = op;
+  in->x = x;
+  in->y = y;
+  return rc->len++;
+}
+
+// emit the nfa of node n, with the parts of every concatenation the
+// other way round if rev is set, so it matches text from right to left
+static void rx_emit(struct rx_compiler *rc, int n, int rev) {
+  struct rx_node *node = &rc->nodes[n];
+  int split, jmp;
+  switch (node->type) {
+    case RX_SET:
+      rx_inst(rc, NFA_SET, node->set, 0);
+      break;
+    case RX_EMPTY:
+      break;
+    case RX_CAT:
+      rx_emit(rc, rev ? node->b : node->a, rev);
+      rx_emit(rc, rev ? node->a : node->b, rev);
+      break;
+    case RX_ALT:
+      split = rx_inst(rc, NFA_SPLIT, rc->len + 1, 0);
+      rx_emit(rc, node->a, rev);
+      jmp = rx_inst(rc, NFA_JMP, 0, 0);
+      rc->code[split].y = rc->len;
+      rx_emit(rc, node->b, rev);
+      rc->code[jmp].x = rc->len;
+      break;
+    case RX_STAR:
+      split = rx_inst(rc, NFA_SPLIT, rc->len + 1, 0);
+      rx_emit(rc, node->a, rev);
+      rx_inst(rc, NFA_JMP, split, 0);
+      rc->code[split].y = rc->len;
+      break;
+    case RX_PLUS:
+      split = rc->len;
+      rx_emit(rc, node->a, rev);
+      rx_inst(rc, NFA_SPLIT, split, rc->len + 1);
+      break;
+    case RX_QUEST:
+      split = rx_inst(rc, NFA_SPLIT, rc->len + 1, 0);
+      rx_emit(rc, node->a, rev);
+      rc->code[split].y = rc->len;
+      break;
+    default: {
+      // the byte before and the byte after swap places right to left
+      static const int ops[] = {NFA_BOL, NFA_EOL, NFA_BOW, NFA_EOW};
+      int k = node->type - RX_BOL;
+      rx_inst(rc, ops[rev ? k ^ 1 : k], 0, 0);
+    }
+  }
+}
+
+static void rx_free(struct regex *re) {
+  if (re == NULL) return;
+  free(re->literal);
+  free(re->sets);
+  free(re->fwd);
+  free(re->rev);
+  free(re);
+}
+
+// compile pattern, NULL with *err set if it is not valid
+static struct regex *rx_compile(const char *pat, int len, const char **err) {
+  struct regex *re = calloc(1, sizeof(struct regex));
+  struct rx_compiler rc;
+  memset(&rc, 0, sizeof(rc));
+  rc.p = pat;
+  rc.end = pat + len;
+  rc.re = re;
+  struct abuf literal = ABUF_INIT;
+  rc.literal = literal;
+  rc.literal.b = malloc(literal.cap);
+  rc.plain = 1;
+
+  int root = rx_alt(&rc);
+  if (rc.err == NULL && rc.p < rc.end) rc.err = "E55: Unmatched \\)";
+  if (rc.err == NULL && rc.plain) {
+    re->literal = rc.literal.b;
+    re->literal_len = rc.literal.len;
+    rc.literal.b = NULL;
+  } else if (rc.err == NULL) {
+    for (int rev = 0; rev < 2; rev++) {
+      rc.code = NULL;
+      rc.len = rc.cap = 0;
+      rx_emit(&rc, root, rev);
+      rx_inst(&rc, NFA_MATCH, 0, 0);
+      if (rev) {
+        re->rev = rc.code;
+      } else {
+        re->fwd = rc.code;
+      }
+    }
+    re->len = rc.len;
+  }
+  free(rc.nodes);
+  free(rc.literal.b);
+  if (rc.err) {
+    *err = rc.err;
+    rx_free(re);
+    return NULL;
+  }
+  return re;
+}
+
+static void dfa_init(struct dfa *d, struct regex *re, struct nfa_inst *code,
+                     int anchored) {
+  d->re = re;
+  d->code = code;
+  d->anchored = anchored;
+  d->trans = NULL;
+  d->nstates = d->statecap = 0;
+  d->setlen = d->setcap = 0;
+  d->gen = 0;
+  if (code == NULL) {
+    d->sets = d->setpos = d->hash = d->list = d->stack = d->mark = NULL;
+    d->kind = NULL;
+    return;
+  }
+  d->setcap = re->len * 4;
+  d->sets = malloc(sizeof(int) * d->setcap);
+  d->setpos = malloc(sizeof(int) * (DFA_STATES_MAX + 1));
+  d->setpos[0] = 0;
+  d->kind = malloc(DFA_STATES_MAX);
+  d->hash = calloc(DFA_STATES_MAX * 2, sizeof(int));
+  // the closure of a state, the set after a byte and a state kept while
+  // the others are dropped
+  d->list = malloc(sizeof(int) * re->len * 3);
+  d->stack = malloc(sizeof(int) * (re->len * 2 + 1));
+  d->mark = calloc(re->len, sizeof(int));
+
+  // every set reached before a byte is consumed, passing all assertions
+  memset(d->first, 0, sizeof(d->first));
+  int sp = 0;
+  d->gen = 1;
+  d->stack[sp++] = 0;
+  while (sp) {
+    int pc = d->stack[--sp];
+    if (d->mark[pc] == d->gen) continue;
+    d->mark[pc] = d->gen;
+    struct nfa_inst *in = &code[pc];
+    if (in->op == NFA_SET) {
+      for (int c = 0; c < 256; c++)
+        d->first[c] |= (re->sets[in->x][c >> 3] >> (c & 7)) & 1;
+    } else if (in->op == NFA_SPLIT) {
+      d->stack[sp++] = in->y;
+      d->stack[sp++] = in->x;
+    } else if (in->op == NFA_JMP) {
+      d->stack[sp++] = in->x;
+    } else if (in->op != NFA_MATCH) {
+      d->stack[sp++] = pc + 1;
+    }
+  }
+  d->nfirst = 0;
+  for (int c = 0; c < 256; c++) {
+    if (d->first[c]) {
+      d->nfirst++;
+      d->firstbyte = c;
+    }
+  }
+}
+
+static void dfa_free(struct dfa *d) {
+  free(d->trans);
+  free(d->sets);
+  free(d->setpos);
+  free(d->kind);
+  free(d->hash);
+  free(d->list);
+  free(d->stack);
+  free(d->mark);
+}
+
+static void dfa_flush(struct dfa *d) {
+  d->nstates = 0;
+  d->setlen = 0;
+  memset(d->hash, 0, sizeof(int) * DFA_STATES_MAX * 2);
+}
+
+// the state with the given set and kind, added if there is none. there
+// must be room for it
+static int dfa_state(struct dfa *d, const int *set, int n, int kind) {
+  unsigned h = 2166136261u ^ kind;
+  for (int i = 0; i < n; i++) h = (h ^ set[i]) * 16777619u;
+  int mask = DFA_STATES_MAX * 2 - 1;
+  for (h &= mask; d->hash[h]; h = (h + 1) & mask) {
+    int s = d->hash[h] - 1;
+    if (d->kind[s] == kind && d->setpos[s + 1] - d->setpos[s] == n &&
+        memcmp(d->sets + d->setpos[s], set, sizeof(int) * n) == 0)
+      return s;
+  }
+
+  int s = d->nstates++;
+  if (s == d->statecap) {
+    d->statecap = d->statecap ? d->statecap * 2 : 16;
+    d->trans = realloc(d->trans, sizeof(int) * DFA_BYTES * d->statecap);
+    if (d->trans == NULL) die("realloc");
+  }
+  memset(d->trans + s * DFA_BYTES, -1, sizeof(int) * DFA_BYTES);
+  if (d->setlen + n > d->setcap) {
+    d->setcap = (d->setlen + n) * 2;
+    d->sets = realloc(d->sets, sizeof(int) * d->setcap);
+    if (d->sets == NULL) die("realloc");
+  }
+  memcpy(d->sets + d->setlen, set, sizeof(int) * n);
+  d->setlen += n;
+  d->setpos[s] = d->setlen - n;
+  d->setpos[s + 1] = d->setlen;
+  d->kind[s] = kind;
+  d->hash[h] = s + 1;
+  return s;
+}
+
+// add pc and what it reaches without consuming a byte to the n
+// instructions in d->list, deciding the assertions by the kinds of the
+// bytes before and after. return how many there are then
+static int dfa_add(struct dfa *d, int pc, int n, int before, int after) {
+  int sp = 0;
+  d->stack[sp++] = pc;
+  while (sp) {
+    pc = d->stack[--sp];
+    if (d->mark[pc] == d->gen) continue;
+    d->mark[pc] = d->gen;
+    struct nfa_inst *in = &d->code[pc];
+    switch (in->op) {
+      case NFA_JMP:
+        d->stack[sp++] = in->x;
+        break;
+      case NFA_SPLIT:
+        d->stack[sp++] = in->y;
+        d->stack[sp++] = in->x;
+        break;
+      case NFA_BOL:
+        if (before == RX_KIND_EOL) d->stack[sp++] = pc + 1;
+        break;
+      case NFA_EOL:
+        if (after == RX_KIND_EOL) d->stack[sp++] = pc + 1;
+        break;
+      case NFA_BOW:
+        if (before != RX_KIND_WORD && after == RX_KIND_WORD)
+          d->stack[sp++] = pc + 1;
+        break;
+      case NFA_EOW:
+        if (before == RX_KIND_WORD && after != RX_KIND_WORD)
+          d->stack[sp++] = pc + 1;
+        break;
+      default:
+        d->list[n++] = pc;
+    }
+  }
+  return n;
+}
+
+// build the transition of state s on byte c, 256 at the end of the text
+static int dfa_step(struct dfa *d, int s, int c) {
+  int before = d->kind[s];
+  int after = rx_kind(c);
+  d->gen++;
+  int n = 0;
+  for (int i = d->setpos[s]; i < d->setpos[s + 1]; i++)
+    n = dfa_add(d, d->sets[i], n, before, after);
+  int match = 0;
+  for (int i = 0; i < n; i++) match |= d->code[d->list[i]].op == NFA_MATCH;
+  // a match may start before c too, after the check so it is not empty
+  if (!d->anchored) n = dfa_add(d, 0, n, before, after);
+
+  int next = s;
+  if (c < 256) {
+    int *to = d->list + d->re->len;
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+      struct nfa_inst *in = &d->code[d->list[i]];
+      if (in->op == NFA_SET && d->re->sets[in->x][c >> 3] & (1 << (c & 7)))
+        to[m++] = d->list[i] + 1;
+    }
+    qsort(to, m, sizeof(int), ed_cmp_int);
+    if (d->nstates >= DFA_STATES_MAX - 1) {
+      // drop all states but s
+      int *keep = d->list + d->re->len * 2;
+      int nkeep = d->setpos[s + 1] - d->setpos[s];
+      memcpy(keep, d->sets + d->setpos[s], sizeof(int) * nkeep);
+      dfa_flush(d);
+      s = dfa_state(d, keep, nkeep, before);
+    }
+    next = dfa_state(d, to, m, after);
+  }
+  int idle = !d->anchored && d->setpos[next] == d->setpos[next + 1];
+  return d->trans[s * DFA_BYTES + c] =
+             next * DFA_BYTES << 2 | idle * DFA_IDLE | match * DFA_MATCH;
+}
+
+// states are run by their offset in trans, the transition of the state
+// at offset s on byte c is trans[s + c], the next offset shifted left by
+// two with DFA_MATCH and DFA_IDLE below it
+static inline int dfa_next(struct dfa *d, int s, int c) {
+  int t = d->trans[s + c];
+  return t >= 0 ? t : dfa_step(d, s / DFA_BYTES, c);
+}
+
+// the state before the first byte, which comes after a byte of kind
+static int dfa_start(struct dfa *d, int kind) {
+  int start = 0;
+  if (d->nstates >= DFA_STATES_MAX - 1) dfa_flush(d);
+  return dfa_state(d, &start, d->anchored, kind) * DFA_BYTES;
+}
+
+static inline int dfa_start_at(struct dfa *d, const char *base,
+                               const char *p) {
+  return dfa_start(d, p == base ? RX_KIND_EOL : rx_kind((unsigned char)p[-1]));
+}
+
+// the first byte from p on a match can start with, end if there is none
+static inline const char *dfa_skip(struct dfa *d, const char *p,
+                                   const char *end) {
+  if (d->nfirst == 1) {
+    p = memchr(p, d->firstbyte, end - p);
+    return p ? p : end;
+  }
+  while (p < end && !d->first[(unsigned char)*p]) p++;
+  return p;
+}
+
+// going backwards, the first byte before p a match can end with
+static inline const char *dfa_skip_back(struct dfa *d, const char *lo,
+                                        const char *p) {
+  if (d->nfirst == 1) {
+    const char *hit = memrchr(lo, d->firstbyte, p - lo);
+    return hit ? hit + 1 : lo;
+  }
+  while (p > lo && !d->first[(unsigned char)p[-1]]) p--;
+  return p;
+}
+
+// where the first match starting at or after p ends, NULL if none ends
+// before end. base is where the text starts
+static const char *dfa_first_end(struct dfa *d, const char *base,
+                                 const char *p, const char *end) {
+  int s = dfa_start_at(d, base, p);
+  int *trans = d->trans;
+  int t;
+  for (;;) {
+    // transitions known to go on without a match, -1 has all bits set
+    while (p < end && !((t = trans[s + (unsigned char)*p]) & 3)) {
+      s = t >> 2;
+      p++;
+    }
+    if (p == end) break;
+    t = dfa_next(d, s, (unsigned char)*p);
+    if (t & DFA_MATCH) return p;
+    s = t >> 2;
+    p++;
+    if (t & DFA_IDLE) {
+      p = dfa_skip(d, p, end);
+      s = dfa_start_at(d, base, p);
+    }
+    trans = d->trans;
+  }
+  return dfa_next(d, s, 256) & DFA_MATCH ? end : NULL;
+}
+
+// where the longest match starting at p ends, NULL if none does
+static const char *dfa_longest(struct dfa *d, const char *base,
+                               const char *p, const char *end) {
+  const char *last = NULL;
+  const char *start = p;
+  int s = dfa_start_at(d, base, p);
+  for (; p < end; p++) {
+    int t = dfa_next(d, s, (unsigned char)*p);
+    if (t & DFA_MATCH && p > start) last = p;
+    s = t >> 2;
+    int k = s / DFA_BYTES;
+    if (d->setpos[k] == d->setpos[k + 1]) return last;  // no match left
+  }
+  return dfa_next(d, s, 256) & DFA_MATCH ? end : last;
+}
+
+// run the backward dfa over [lo, hi), hi being at a line end or the end
+// of the text. return the last match starting before below, or if count
+// is given, the first one and add how many there are to *count
+static const char *dfa_back(struct dfa *d, const char *base, const char *lo,
+                            const char *hi, const char *end,
+                            const char *below, long *count) {
+  const char *found = NULL;
+  int s = dfa_start(d, hi == end ? RX_KIND_EOL : rx_kind((unsigned char)*hi));
+  int *trans = d->trans;
+  const char *p = hi;
+  int t;
+  for (;;) {
+    while (p > lo && !((t = trans[s + (unsigned char)p[-1]]) & 3)) {
+      s = t >> 2;
+      p--;
+    }
+    t = dfa_next(d, s, p > base ? (unsigned char)p[-1] : 256);
+    if (t & DFA_MATCH && p < below) {
+      if (count == NULL) return p;
+      (*count)++;
+      found = p;
+    }
+    if (p == lo) break;
+    s = t >> 2;
+    p--;
+    if (t & DFA_IDLE) {
+      p = dfa_skip_back(d, lo, p);
+      s = dfa_start(d, rx_kind((unsigned char)*p));
+    }
+    trans = d->trans;
+  }
+  return found;
+}
+
+// the dfas of m are built as they are used
+static void rx_matcher_init(struct matcher *m, struct regex *re, int gen) {
+  m->re = re;
+  m->gen = gen;
+  int nfa = re != NULL && re->literal == NULL;
+  dfa_init(&m->fwd, re, nfa ? re->fwd : NULL, 0);
+  dfa_init(&m->rev, re, nfa ? re->rev : NULL, 0);
+  dfa_init(&m->match, re, nfa ? re->fwd : NULL, 1);
+}
+
+static void rx_matcher_free(struct matcher *m) {
+  dfa_free(&m->fwd);
+  dfa_free(&m->rev);
+  dfa_free(&m->match);
+}
+
+// the text is [base, end), which is one or more lines. rx_find() returns
+// where the first match starting at or after from starts, NULL if there
+// is none
+static const char *rx_find(struct matcher *m, const char *base,
+                           const char *from, const char *end) {
+  struct regex *re = m->re;
+  if (re->literal)
+    return ed_find(from, end - from, re->literal, re->literal_len);
+  const char *e = dfa_first_end(&m->fwd, base, from, end);
+  if (e == NULL) return NULL;
+  // the first match to start is on the line of the first one to end
+  const char *start = e;
+  while (start > from && !rx_is_eol((unsigned char)start[-1])) start--;
+  const char *eol = e;
+  while (eol < end && !rx_is_eol((unsigned char)*eol)) eol++;
+  long n = 0;
+  return dfa_back(&m->rev, base, start, eol, end, eol, &n);
+}
+
+// where the last match starting before below starts
+static const char *rx_last(struct matcher *m, const char *base,
+                           const char *below, const char *end) {
+  struct regex *re = m->re;
+  if (re->literal) {
+    int len = re->literal_len;
+    const char *last = NULL;
+    const char *hit = base;
+    if (end - below > len - 1) end = below + len - 1;
+    while ((hit = ed_find(hit, end - hit, re->literal, len)) != NULL) {
+      last = hit;
+      hit++;
+    }
+    return last;
+  }
+  // matches starting before below end on its line at the latest
+  const char *eol = below;
+  while (eol < end && !rx_is_eol((unsigned char)*eol)) eol++;
+  return dfa_back(&m->rev, base, base, eol, end, below, NULL);
+}
+
+// how many matches start before below
+static long rx_count(struct matcher *m, const char *base, const char *below,
+                     const char *end) {
+  struct regex *re = m->re;
+  long n = 0;
+  if (re->literal) {
+    int len = re->literal_len;
+    const char *hit = base;
+    if (end - below > len - 1) end = below + len - 1;
+    while ((hit = ed_find(hit, end - hit, re->literal, len)) != NULL) {
+      n++;
+      hit++;
+    }
+    return n;
+  }
+  const char *eol = below;
+  while (eol < end && !rx_is_eol((unsigned char)*eol)) eol++;
+  if (m->fwd.nfirst >= m->rev.nfirst) {
+    // matches end with rarer bytes than they start with, run backwards
+    dfa_back(&m->rev, base, base, eol, end, below, &n);
+    return n;
+  }
+  // only the lines the forward dfa finds a match on are run backwards
+  const char *p = base;
+  const char *e;
+  while (p < eol && (e = dfa_first_end(&m->fwd, base, p, eol)) != NULL) {
+    const char *start = e;
+    while (start > p && !rx_is_eol((unsigned char)start[-1])) start--;
+    const char *lineend = e;
+    while (lineend < eol && !rx_is_eol((unsigned char)*lineend)) lineend++;
+    dfa_back(&m->rev, base, start, lineend, end, below, &n);
+    p = lineend;
+  }
+  return n;
+}
+
+// where the longest match starting at p ends, NULL if none starts there
+static const char *rx_match_end(struct matcher *m, const char *base,
+                                const char *p, const char *end) {
+  struct regex *re = m->re;
+  if (re->literal) {
+    int len = re->literal_len;
+    return end - p >= len && memcmp(p, re->literal, len) == 0 ? p + len
+                                                              : NULL;
+  }
+  return dfa_longest(&m->match, base, p, end);
+}
+
+// true if the empty string matches between a byte of kind before and one
+// of kind after, like ^ does at the start of a line
+static int rx_empty_at(struct matcher *m, int before, int after) {
+  struct dfa *d = &m->match;
+  if (d->code == NULL) return 0;
+  d->gen++;
+  int n = dfa_add(d, 0, 0, before, after);
+  for (int i = 0; i < n; i++)
+    if (d->code[d->list[i]].op == NFA_MATCH) return 1;
+  return 0;
+}
+
+// true if the regex of m matches the empty string anywhere
+static int rx_can_be_empty(struct matcher *m) {
+  for (int before = RX_KIND_EOL; before <= RX_KIND_OTHER; before++)
+    for (int after = RX_KIND_EOL; after <= RX_KIND_OTHER; after++)
+      if (rx_empty_at(m, before, after)) return 1;
+  return 0;
+}
+
+/* search */
+
+// first occurrence of n in h, n is at least 2 bytes and not longer than h
+static const char *ed_find_scalar(const char *h, size_t hlen, const char *n,
+                                  size_t nlen) {
+  const char *p = h;
+  const char *last = h + hlen - nlen;
+  while (p <= last && (p = memchr(p, n[0], last - p + 1)) != NULL) {
+    if (memcmp(p + 1, n + 1, nlen - 1) == 0) return p;
+    p++;
+  }
+  return NULL;
+}
+
+#ifdef ED_SIMD_X86
+// compare a block of h with the first byte of n and the block nlen - 1
+// further on with the last byte of n, so only the bits set in both masks
+// are possible matches, checked with memcmp. the tail shorter than a
+// block goes to ed_find_scalar()
+static const char *ed_find_sse2(const char *h, size_t hlen, const char *n,
+                                size_t nlen) {
+  const __m128i first = _mm_set1_epi8(n[0]);
+  const __m128i last = _mm_set1_epi8(n[nlen - 1]);
+  size_t i = 0;
+  for (; i + nlen - 1 + 16 <= hlen; i += 16) {
+    __m128i bf = _mm_loadu_si128((const __m128i *)(h + i));
+    __m128i bl = _mm_loadu_si128((const __m128i *)(h + i + nlen - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(h + i + bit + 1, n + 1, nlen - 2) == 0) return h + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return i + nlen <= hlen ? ed_find_scalar(h + i, hlen - i, n, nlen) : NULL;
+}
+
+__attribute__((target("avx2"))) static const char *ed_find_avx2(
+    const char *h, size_t hlen, const char *n, size_t nlen) {
+  const __m256i first = _mm256_set1_epi8(n[0]);
+  const __m256i last = _mm256_set1_epi8(n[nlen - 1]);
+  size_t i = 0;
+  for (; i + nlen - 1 + 32 <= hlen; i += 32) {
+    __m256i bf = _mm256_loadu_si256((const __m256i *)(h + i));
+    __m256i bl = _mm256_loadu_si256((const __m256i *)(h + i + nlen - 1));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(bf, first), _mm256_cmpeq_epi8(bl, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(h + i + bit + 1, n + 1, nlen - 2) == 0) return h + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return i + nlen <= hlen ? ed_find_sse2(h + i, hlen - i, n, nlen) : NULL;
+}
+#endif
+
+static const char *(*ed_find_kernel)(const char *, size_t, const char *,
+                                     size_t);
+
+static void ed_find_pick() {
+  ed_find_kernel = ed_find_scalar;
+#ifdef ED_SIMD_X86
+  ed_find_kernel =
+      __builtin_cpu_supports("avx2") ? ed_find_avx2 : ed_find_sse2;
+#endif
+}
+
+// first occurrence of n[0, nlen) in h[0, hlen), NULL if there is none.
+// the widest kernel the cpu supports is picked on the first call
+const char *ed_find(const char *h, size_t hlen, const char *n, size_t nlen) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  if (nlen == 0) return h;
+  if (nlen > hlen) return NULL;
+  if (nlen == 1) return memchr(h, n[0], hlen);
+  pthread_once(&once, ed_find_pick);
+  return ed_find_kernel(h, hlen, n, nlen);
+}
+
+// true if only line ends lie between two rows pointing into the map, so
+// they can be searched as one span: the pattern never matches a line end
+static inline int ed_rows_adjacent(TextRow *row, TextRow *next) {
+  if (row->cap || next->cap || row->store || next->store) return 0;
+  const char *end = row->string + row->size;
+  if (next->string <= end) return 0;
+  while (end < next->string && (*end == '\n' || *end == '\r')) end++;
+  return end == next->string;
+}
+
+// rows still pointing into the map one after another from row r on are
+// searched at once, set [*s, *end) to their text and return the row
+// after them, at most to
+static int ed_row_span(int r, int to, const char **s, const char **end) {
+  int next = r + 1;
+  while (next < to && ed_rows_adjacent(ed_row(next - 1), ed_row(next)))
+    next++;
+  TextRow *last = ed_row(next - 1);
+  *s = ed_row(r)->string;
+  *end = last->string + last->size;
+  return next;
+}
+
+// m running re, rebuilt once gen changed
+static struct matcher *rx_matcher_sync(struct matcher *m, struct regex *re,
+                                       int gen) {
+  if (m->gen != gen) {
+    rx_matcher_free(m);
+    rx_matcher_init(m, re, gen);
+  }
+  return m;
+}
+
+// m running the current pattern
+static struct matcher *ed_matcher(struct matcher *m) {
+  return rx_matcher_sync(m, editor.search.re, editor.search.gen);
+}
+
+// the row of the hit in the rows from r on
+static inline int ed_hit_row(int r, const char *hit) {
+  while (hit >= ed_row(r)->string + ed_row(r)->size) r++;
+  return r;
+}
+
+// search rows [from, to) with m, return the row of the first match, or
+// of the last one if last is set, -1 if there is none. *pos is set to
+// where the match starts in the row's string
+static int ed_search_rows(struct matcher *m, int from, int to, int last,
+                          int *pos) {
+  int found = -1;
+  int r = from;
+  while (r < to) {
+    const char *span, *spanend;
+    int end = ed_row_span(r, to, &span, &spanend);
+    const char *hit = last ? rx_last(m, span, spanend, spanend)
+                           : rx_find(m, span, span, spanend);
+    if (hit) {
+      found = ed_hit_row(r, hit);
+      *pos = hit - ed_row(found)->string;
+      if (!last) return found;
+    }
+    r = end;
+  }
+  return found;
+}
+
+// matches in rows [from, to), counting every byte a match starts at as n
+// moves to them. called from the search workers as well
+static long ed_count_rows(struct matcher *m, int from, int to) {
+  long n = 0;
+  int r = from;
+  while (r < to) {
+    const char *span, *spanend;
+    r = ed_row_span(r, to, &span, &spanend);
+    n += rx_count(m, span, spanend, spanend);
+  }
+  return n;
+}
+
+// count the next chunk of the posted job with m, called with the pool
+// locked, which is unlocked meanwhile. return 0 if there is none left
+static int ed_count_chunk(struct search_pool *sp, struct matcher *m) {
+  if (sp->cancel || sp->next >= sp->nchunks) return 0;
+  int k = sp->next++;
+  sp->busy++;
+  pthread_mutex_unlock(&sp->lock);
+  int from = k * SEARCH_BLOCK_ROWS;
+  int to = from + SEARCH_BLOCK_ROWS;
+  long n = ed_count_rows(m, from, to < editor.numrows ? to : editor.numrows);
+  pthread_mutex_lock(&sp->lock);
+  editor.search.counts[k] = n;
+  sp->busy--;
+  return 1;
+}
+
+// arg is the worker's matcher, brought up to date before chunks are posted
+static void *ed_search_worker(void *arg) {
+  struct search_pool *sp = &editor.pool;
+  pthread_mutex_lock(&sp->lock);
+  for (;;) {
+    if (ed_count_chunk(sp, arg)) {
+      pthread_cond_signal(&sp->idle);
+    } else {
+      pthread_cond_wait(&sp->work, &sp->lock);
+    }
+  }
+  return NULL;
+}
+
+// one worker per cpu besides the main thread, started on the first count
+static void ed_search_pool_start() {
+  struct search_pool *sp = &editor.pool;
+  if (sp->nthreads >= 0) return;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu > SEARCH_THREADS_MAX) ncpu = SEARCH_THREADS_MAX;
+  sp->nthreads = ncpu > 1 ? ncpu - 1 : 0;
+  sp->threads = malloc(sizeof(pthread_t) * (sp->nthreads + 1));
+  sp->matchers = malloc(sizeof(struct matcher) * (sp->nthreads + 1));
+  for (int i = 0; i < sp->nthreads; i++)
+    rx_matcher_init(&sp->matchers[i], NULL, 0);
+  sp->next = sp->nchunks = sp->busy = 0;
+  sp->cancel = 0;
+  pthread_mutex_init(&sp->lock, NULL);
+  pthread_cond_init(&sp->work, NULL);
+  pthread_cond_init(&sp->idle, NULL);
+  for (int i = 0; i < sp->nthreads; i++) {
+    // the main thread counts alone if no worker can be started
+    if (pthread_create(&sp->threads[i], NULL, ed_search_worker,
+                       &sp->matchers[i]) != 0) {
+      sp->nthreads = i;
+      break;
+    }
+  }
+}
+
+// count the matches in every chunk not counted yet, sharing the chunks
+// out to the workers in row order. return 0 if a key was pressed before
+// all of them were counted, the chunks counted so far are kept
+static int ed_search_count() {
+  struct search *s = &editor.search;
+  struct search_pool *sp = &editor.pool;
+  int nchunks = (editor.numrows + SEARCH_BLOCK_ROWS - 1) / SEARCH_BLOCK_ROWS;
+  if (s->counted < nchunks) {
+    if (nchunks > s->counts_cap) {
+      s->counts_cap = nchunks * 2;
+      s->counts = realloc(s->counts, sizeof(long) * s->counts_cap);
+      if (s->counts == NULL) die("realloc");
+    }
+    for (int k = s->counted; k < nchunks; k++) s->counts[k] = -1;
+    ed_search_pool_start();
+    struct matcher *m = ed_matcher(&s->matcher);
+    for (int i = 0; i < sp->nthreads; i++) ed_matcher(&sp->matchers[i]);
+
+    pthread_mutex_lock(&sp->lock);
+    sp->next = s->counted;
+    sp->nchunks = nchunks;
+    sp->cancel = 0;
+    pthread_cond_broadcast(&sp->work);
+    while (ed_count_chunk(sp, m)) {
+      pthread_mutex_unlock(&sp->lock);
+      int pending = ed_input_pending();
+      pthread_mutex_lock(&sp->lock);
+      if (pending) sp->cancel = 1;
+    }
+    while (sp->busy) pthread_cond_wait(&sp->idle, &sp->lock);
+    sp->next = sp->nchunks = 0;
+    pthread_mutex_unlock(&sp->lock);
+
+    while (s->counted < nchunks && s->counts[s->counted] >= 0) s->counted++;
+    if (s->counted < nchunks) return 0;
+  }
+  s->counted = nchunks;
+  s->total = 0;
+  for (int k = 0; k < nchunks; k++) s->total += s->counts[k];
+  return 1;
+}
+
+// true if the matches of every row are counted
+static inline int ed_search_counted() {
+  return !editor.loading &&
+         editor.search.counted * SEARCH_BLOCK_ROWS >= editor.numrows;
+}
+
+// 1 based index of the match starting at pos in row rpos, merging the
+// chunk counts before it with the matches before it in its chunk
+static long ed_search_index(int rpos, int pos) {
+  int k = rpos / SEARCH_BLOCK_ROWS;
+  long index = 0;
+  for (int i = 0; i < k; i++) index += editor.search.counts[i];
+  struct matcher *m = ed_matcher(&editor.search.matcher);
+  index += ed_count_rows(m, k * SEARCH_BLOCK_ROWS, rpos);
+  TextRow *row = ed_row(rpos);
+  return index + rx_count(m, row->string, row->string + pos + 1,
+                          row->string + row->size);
+}
+
+// string index of the render column rx, found a run between tabs at a
+// time
+static int ed_rx_to_pos(TextRow *row, int rx) {
+  const char *s = row->string;
+  const char *end = s + row->size;
+  int x = 0;  // render column of s
+  while (s < end) {
+    const char *tab = memchr(s, '\t', end - s);
+    int run = (tab ? tab : end) - s;
+    if (x + run > rx) return s - row->string + rx - x;
+    if (tab == NULL) break;
+    x += run;
+    s += run;
+    if (x + TAB_SIZE > rx) return s - row->string;
+    x += TAB_SIZE;
+    s++;
+  }
+  return row->size;
+}
+
+// put the cursor on string index pos of row rpos, clamped to the row
+static void ed_cursor_to(int rpos, int pos) {
+  TextRow *row = ed_row(rpos);
+  if (pos > row->size) pos = row->size;
+  if (pos < 0) pos = 0;
+  editor.cy = rpos;
+  editor.cx = TEXT_START + pos +
+              ed_count_tabs(row->string, pos) * (TAB_SIZE - 1);
+}
+
+// string index of the cursor in its row. cx is a render column, so
+// edits at the cursor go through this, never through CURRENT_COL
+static int ed_cursor_pos() {
+  if (editor.cy >= editor.numrows || CURRENT_COL <= 0) return 0;
+  return ed_rx_to_pos(ed_row(CURRENT_ROW), CURRENT_COL);
+}
+
+static void ed_search_goto(int rpos, int pos) {
+  ed_cursor_to(rpos, pos);
+  editor.prev_cx = editor.cx;
+  editor.search.row = rpos;
+  editor.search.cx = editor.cx;
+  editor.search.index = ed_search_counted() ? ed_search_index(rpos, pos) : 0;
+}
+
+// where the first match in row rpos after string index cur starts, or
+// the last one before it if dir < 0, -1 if there is none
+static int ed_search_in_row(struct matcher *m, int rpos, int cur, int dir) {
+  TextRow *row = ed_row(rpos);
+  const char *rowend = row->string + row->size;
+  const char *hit = NULL;
+  if (dir > 0) {
+    if (cur + 1 < row->size)
+      hit = rx_find(m, row->string, row->string + cur + 1, rowend);
+  } else {
+    hit = rx_last(m, row->string, row->string + cur, rowend);
+  }
+  return hit ? hit - row->string : -1;
+}
+
+// true if the chunk of rows [r, r + SEARCH_BLOCK_ROWS) is known to have
+// no match
+static inline int ed_chunk_empty(int r) {
+  return ed_search_counted() &&
+         editor.search.counts[r / SEARCH_BLOCK_ROWS] == 0;
+}
+
+// search rows [from, to) a chunk at a time, backwards if dir < 0,
+// skipping chunks counted without a match and giving up when a key is
+// pressed meanwhile. rows are loaded as they are needed going forward.
+// return the row found, -1 if there is none, -2 if the search was
+// interrupted
+static int ed_search_blocks(int from, int to, int dir, int *pos) {
+  struct matcher *m = ed_matcher(&editor.search.matcher);
+  if (dir > 0) {
+    int r = from;
+    while (r < to) {
+      if (r >= editor.numrows) {
+        if (!editor.loading) break;
+        ed_load_rows(editor.numrows + 1);
+        continue;
+      }
+      int end = (r / SEARCH_BLOCK_ROWS + 1) * SEARCH_BLOCK_ROWS;
+      if (end > to) end = to;
+      if (end > editor.numrows) end = editor.numrows;
+      if (!ed_chunk_empty(r)) {
+        int found = ed_search_rows(m, r, end, 0, pos);
+        if (found >= 0) return found;
+        if (ed_input_pending()) return -2;
+      }
+      r = end;
+    }
+  } else {
+    int r = to;
+    while (r > from) {
+      int start = (r - 1) / SEARCH_BLOCK_ROWS * SEARCH_BLOCK_ROWS;
+      if (start < from) start = from;
+      if (!ed_chunk_empty(start)) {
+        int found = ed_search_rows(m, start, r, 1, pos);
+        if (found >= 0) return found;
+        if (ed_input_pending()) return -2;
+      }
+      r = start;
+    }
+  }
+  return -1;
+}
+
+// move to the next match of the last pattern, dir 1 searches forward
+// and -1 backward, wrapping around the end of the file like vim
+void ed_search_next(int dir) {
+  if (editor.search.pattern == NULL) {
+    ed_set_commandmsg("no previous pattern");
+    return;
+  }
+  if (editor.numrows == 0) return;
+  const char *pat = editor.search.pattern;
+  // the whole buffer is counted once it is loaded, and again from the
+  // first row edited since
+  if (!editor.loading && !ed_search_count()) {
+    ed_set_commandmsg("search interrupted");
+    return;
+  }
+  if (ed_search_counted() && editor.search.total == 0) {
+    ed_set_commandmsg("Pattern not found: %s", pat);
+    return;
+  }
+  struct matcher *m = ed_matcher(&editor.search.matcher);
+  int cy = CURRENT_ROW < editor.numrows ? CURRENT_ROW : editor.numrows - 1;
+  int cur = ed_rx_to_pos(ed_row(cy), CURRENT_COL);
+  int pos = ed_search_in_row(m, cy, cur, dir);
+  int found = pos >= 0 ? cy : -1;
+  int wrapped = 0;
+
+  if (dir > 0) {
+    // the rest of the current row, the rows after it, then from the top
+    if (found == -1) found = ed_search_blocks(cy + 1, INT_MAX, 1, &pos);
+    if (found == -1) {
+      wrapped = 1;
+      found = ed_search_blocks(0, cy + 1, 1, &pos);
+    }
+  } else {
+    // the current row before the cursor, the rows before it, then from
+    // the bottom. all of the file is needed for that
+    if (found == -1) found = ed_search_blocks(0, cy, -1, &pos);
+    if (found == -1) {
+      wrapped = 1;
+      while (editor.loading && found != -2) {
+        ed_load_rows(editor.numrows + 1);
+        if (ed_input_pending()) found = -2;
+      }
+      if (found == -1) found = ed_search_blocks(cy, editor.numrows, -1, &pos);
+    }
+  }
+
+  if (found == -2) {
+    ed_set_commandmsg("search interrupted");
+  } else if (found == -1) {
+    ed_set_commandmsg("Pattern not found: %s", pat);
+  } else {
+    ed_search_goto(found, pos);
+    if (wrapped) {
+      ed_set_commandmsg(dir > 0 ? "search hit BOTTOM, continuing at TOP"
+                                : "search hit TOP, continuing at BOTTOM");
+    } else {
+      ed_set_commandmsg("%c%s", dir > 0 ? '/' : '?', pat);
+    }
+  }
+}
+
+// make pat the last pattern, return 0 if it is not a valid regex
+static int ed_search_set(char *pat) {
+  const char *err;
+  struct regex *re = rx_compile(pat, strlen(pat), &err);
+  if (re == NULL) {
+    ed_set_commandmsg("%s", err);
+    free(pat);
+    return 0;
+  }
+  free(editor.search.pattern);
+  rx_free(editor.search.re);
+  editor.search.pattern = pat;
+  editor.search.len = strlen(pat);
+  editor.search.re = re;
+  editor.search.gen++;
+  editor.search.counted = 0;
+  return 1;
+}
+
+// the incremental search thread, scans INCSEARCH_ROWS rows at a time
+// until it finds a match. rows only change while it is paused
+static void *ed_incsearch_worker(void *arg) {
+  struct incsearch *is = arg;
+  pthread_mutex_lock(&is->lock);
+  for (;;) {
+    if (!is->scanning || is->pause || is->waiting) {
+      pthread_cond_wait(&is->work, &is->lock);
+      continue;
+    }
+    int dir = is->dir;
+    int from = is->from[is->range];
+    int to = is->to[is->range];
+    int rows = to < editor.numrows ? to : editor.numrows;
+    int more = editor.loading && to > editor.numrows;
+    int a, b;
+    if (dir > 0) {
+      a = is->next < from ? from : is->next;
+      b = rows - a > INCSEARCH_ROWS ? a + INCSEARCH_ROWS : rows;
+    } else {
+      // backwards from the end of the range, once it is loaded
+      if (is->next < 0 && more) {
+        is->waiting = 1;
+        continue;
+      }
+      b = is->next < 0 ? rows : is->next;
+      a = b - from > INCSEARCH_ROWS ? b - INCSEARCH_ROWS : from;
+    }
+    if (a >= b) {
+      if (more) {
+        is->waiting = 1;
+      } else if (++is->range == 2) {
+        is->scanning = 0;
+      } else {
+        is->next = -1;
+      }
+      continue;
+    }
+
+    struct regex *re = is->re;
+    int gen = is->gen;
+    is->busy = 1;
+    pthread_mutex_unlock(&is->lock);
+    struct matcher *m = rx_matcher_sync(&is->matcher, re, gen);
+    int pos;
+    int found = ed_search_rows(m, a, b, dir < 0, &pos);
+    pthread_mutex_lock(&is->lock);
+    is->busy = 0;
+    pthread_cond_signal(&is->idle);
+    if (found >= 0) {
+      is->found = found;
+      is->pos = pos;
+      is->scanning = 0;
+      ed_wake();
+    } else {
+      is->next = dir > 0 ? b : a;
+    }
+  }
+  return NULL;
+}
+
+// started on the first incremental search
+static void ed_incsearch_start() {
+  struct incsearch *is = &editor.incsearch;
+  if (is->started) return;
+  pthread_mutex_init(&is->lock, NULL);
+  pthread_cond_init(&is->work, NULL);
+  pthread_cond_init(&is->idle, NULL);
+  rx_matcher_init(&is->matcher, NULL, 0);
+  is->scanning = is->busy = is->pause = is->waiting = 0;
+  is->found = -1;
+  if (pthread_create(&is->thread, NULL, ed_incsearch_worker, is) != 0)
+    die("pthread_create");
+  is->started = 1;
+}
+
+// hold the scan, return once the thread reads no rows
+static void ed_incsearch_pause() {
+  struct incsearch *is = &editor.incsearch;
+  if (!is->started) return;
+  pthread_mutex_lock(&is->lock);
+  is->pause = 1;
+  while (is->busy) pthread_cond_wait(&is->idle, &is->lock);
+  pthread_mutex_unlock(&is->lock);
+}
+
+// let the scan go on, over the rows loaded meanwhile if it waited for them
+static void ed_incsearch_resume() {
+  struct incsearch *is = &editor.incsearch;
+  if (!is->started) return;
+  pthread_mutex_lock(&is->lock);
+  is->pause = is->waiting = 0;
+  pthread_cond_signal(&is->work);
+  pthread_mutex_unlock(&is->lock);
+}
+
+static void ed_incsearch_show(int rpos, int pos) {
+  ed_cursor_to(rpos, pos);
+  editor.incsearch.row = rpos;
+  editor.incsearch.hit = pos;
+}
+
+// move to the match the thread found, called when it wakes the main loop
+void ed_incsearch_poll() {
+  struct incsearch *is = &editor.incsearch;
+  pthread_mutex_lock(&is->lock);
+  int found = is->found;
+  int pos = is->pos;
+  is->found = -1;
+  pthread_mutex_unlock(&is->lock);
+  if (found >= 0) ed_incsearch_show(found, pos);
+}
+
+// called by ed_prompt() as the pattern is typed. the next match in the
+// window is moved to at once, otherwise the thread scans the rows past
+// the window and wraps around, starting over whenever this is called
+static void ed_incsearch(const char *pat, int len) {
+  struct incsearch *is = &editor.incsearch;
+  ed_incsearch_start();
+  pthread_mutex_lock(&is->lock);
+  is->pause = 1;
+  while (is->busy) pthread_cond_wait(&is->idle, &is->lock);
+  is->scanning = 0;
+  is->found = -1;
+  rx_free(is->re);
+  // nothing is highlighted while the pattern is not valid
+  const char *err;
+  is->re = len ? rx_compile(pat, len, &err) : NULL;
+  is->gen++;
+  pthread_mutex_unlock(&is->lock);
+
+  editor.cy = is->cy;
+  editor.cx = is->cx;
+  editor.row_offset = is->row_offset;
+  editor.col_offset = is->col_offset;
+  is->row = -1;
+  if (is->re == NULL || editor.numrows == 0) {
+    ed_incsearch_resume();
+    return;
+  }
+
+  struct matcher *m = rx_matcher_sync(&is->draw, is->re, is->gen);
+  int cy = is->cy < editor.numrows ? is->cy : editor.numrows - 1;
+  int cur = ed_rx_to_pos(ed_row(cy), is->cx - TEXT_START);
+  int top = editor.row_offset;
+  int bottom = editor.numrows - top > editor.winrows ? top + editor.winrows
+                                                      : editor.numrows;
+  int pos = ed_search_in_row(m, cy, cur, is->dir);
+  int found = pos >= 0 ? cy : -1;
+  if (found == -1) {
+    found = is->dir > 0 ? ed_search_rows(m, cy + 1, bottom, 0, &pos)
+                        : ed_search_rows(m, top, cy, 1, &pos);
+  }
+  if (found >= 0) {
+    ed_incsearch_show(found, pos);
+    ed_incsearch_resume();
+    return;
+  }
+
+  pthread_mutex_lock(&is->lock);
+  if (is->dir > 0) {
+    // below the window, then from the top
+    is->from[0] = bottom;
+    is->to[0] = INT_MAX;
+    is->from[1] = 0;
+    is->to[1] = cy + 1;
+  } else {
+    // above the window, then from the bottom
+    is->from[0] = 0;
+    is->to[0] = top;
+    is->from[1] = cy;
+    is->to[1] = INT_MAX;
+  }
+  is->range = 0;
+  is->next = -1;
+  is->scanning = 1;
+  is->pause = is->waiting = 0;
+  pthread_cond_signal(&is->work);
+  pthread_mutex_unlock(&is->lock);
+}
+
+// stop the scan and drop the pattern as the prompt closes, the cursor
+// and the view go back to where they were
+static void ed_incsearch_end() {
+  struct incsearch *is = &editor.incsearch;
+  if (is->started) {
+    pthread_mutex_lock(&is->lock);
+    is->scanning = 0;
+    while (is->busy) pthread_cond_wait(&is->idle, &is->lock);
+    is->found = -1;
+    pthread_mutex_unlock(&is->lock);
+  }
+  rx_free(is->re);
+  is->re = NULL;
+  editor.cy = is->cy;
+  editor.cx = is->cx;
+  editor.row_offset = is->row_offset;
+  editor.col_offset = is->col_offset;
+  is->row = -1;
+}
+
+// append the part of row shown in the window, with the matches of the
+// pattern being typed highlighted and the one moved to reversed
+static void ed_draw_matches(struct abuf *ab, TextRow *row,
+                            const unsigned char *hl, int filerow) {
+  struct incsearch *is = &editor.incsearch;
+  struct matcher *m = rx_matcher_sync(&is->draw, is->re, is->gen);
+  const char *s = row->string;
+  const char *end = s + row->size;
+  // render columns, matches are drawn up to last
+  int col = editor.col_offset;
+  int last = row->rsize - col > editor.wincols ? col + editor.wincols
+                                               : row->rsize;
+  const char *p = s;
+  const char *counted = s;  // tabs before it are counted
+  int tabs = 0;
+  const char *hit;
+  while (col < last && p < end && (hit = rx_find(m, s, p, end)) != NULL) {
+    const char *e = rx_match_end(m, s, hit, end);
+    if (e == NULL) e = hit + 1;
+    tabs += ed_count_tabs(counted, hit - counted);
+    counted = hit;
+    int hs = hit - s + tabs * (TAB_SIZE - 1);
+    if (hs >= last) break;
+    int he = e - s + (tabs + ed_count_tabs(hit, e - hit)) * (TAB_SIZE - 1);
+    if (he > last) he = last;
+    if (he > col) {
+      if (hs > col) {
+        ed_draw_span(ab, row, hl, col, hs);
+        col = hs;
+      }
+      if (filerow == is->row && hit - s == is->hit) {
+        ab_append(ab, "\x1b[7m", 4);
+      } else {
+        ab_append(ab, "\x1b[30;43m", 8);
+      }
+      ab_append(ab, row->render + col, he - col);
+      ab_append(ab, "\x1b[m", 3);
+      col = he;
+    }
+    p = e;
+  }
+  ed_draw_span(ab, row, hl, col, last);
+}
+
+// / and ?, an empty pattern searches for the last one again. matches
+// are shown as the pattern is typed
+void ed_search(int dir) {
+  struct incsearch *is = &editor.incsearch;
+  is->dir = dir;
+  is->cy = editor.cy;
+  is->cx = editor.cx;
+  is->row_offset = editor.row_offset;
+  is->col_offset = editor.col_offset;
+  char *pat = ed_prompt(dir > 0 ? "/" : "?", ed_incsearch);
+  ed_incsearch_end();
+  if (pat == NULL) return;
+  if (pat[0]) {
+    if (!ed_search_set(pat)) return;
+  } else {
+    free(pat);
+  }
+  editor.search.dir = dir;
+  ed_search_next(dir);
+}
+
+/* commands */
+
+// cut s at the first delim not escaped with a \, which is dropped from
+// \delim. return what follows the delim, NULL if there is none
+static char *ed_cut_at(char *s, char delim) {
+  char *out = s;
+  for (; *s; s++) {
+    if (*s == '\\' && s[1] == delim) {
+      *out++ = *++s;
+    } else if (*s == '\\' && s[1]) {
+      *out++ = *s++;
+      *out++ = *s;
+    } else if (*s == delim) {
+      *out = '\0';
+      return s + 1;
+    } else {
+      *out++ = *s;
+    }
+  }
+  *out = '\0';
+  return NULL;
+}
+
+// the escape in rep a replacement can't hold, 0 if there is none
+static int ed_rep_bad_escape(const char *rep) {
+  for (; *rep; rep++) {
+    if (*rep != '\\' || rep[1] == '\0') continue;
+    rep++;
+    if (*rep != '\\' && *rep != '&' && *rep != 't') return *rep;
+  }
+  return 0;
+}
+
+// replace the first match in row rpos, or all of them if global is set,
+// return how many were replaced. & in rep stands for the match. if the
+// regex can match the empty string, every position is tried like vim
+// does, except right where the match before ended
+static int ed_substitute_row(struct matcher *m, int rpos, const char *rep,
+                             int global, int empty, struct abuf *out) {
+  TextRow *row = ed_row(rpos);
+  // the matches are all found first and replaced from the last one, so
+  // the positions before it stay right
+  int *matches = NULL;
+  int n = 0;
+  int cap = 0;
+  const char *s = row->string;
+  const char *end = s + row->size;
+  const char *p = s;
+  const char *hit;
+  const char *last = NULL;
+  while (p <= end) {
+    const char *e;
+    if (empty) {
+      hit = p;
+      e = p < end ? rx_match_end(m, s, p, end) : NULL;
+      if (e == NULL) {
+        int before = p == s ? RX_KIND_EOL : rx_kind((unsigned char)p[-1]);
+        int after = p == end ? RX_KIND_EOL : rx_kind((unsigned char)*p);
+        if (p == last || !rx_empty_at(m, before, after)) {
+          p++;
+          continue;
+        }
+        e = p;
+      }
+    } else {
+      if (p == end || (hit = rx_find(m, s, p, end)) == NULL) break;
+      e = rx_match_end(m, s, hit, end);
+    }
+    if (n == cap) {
+      cap = cap ? cap * 2 : 8;
+      matches = realloc(matches, sizeof(int) * 2 * cap);
+      if (matches == NULL) die("realloc");
+    }
+    matches[2 * n] = hit - s;
+    matches[2 * n + 1] = e - s;
+    n++;
+    if (!global) break;
+    last = e;
+    p = e > hit ? e : e + 1;
+  }
+  for (int i = n - 1; i >= 0; i--) {
+    int start = matches[2 * i];
+    int len = matches[2 * i + 1] - start;
+    out->len = 0;
+    for (const char *r = rep; *r; r++) {
+      if (*r == '&') {
+        ab_append(out, row->string + start, len);
+      } else if (*r == '\\' && r[1]) {
+        r++;
+        ab_append(out, *r == 't' ? "\t" : r, 1);
+      } else {
+        ab_append(out, r, 1);
+      }
+    }
+    ed_row_delete(row, start, len);
+    ed_row_insert_str(row, start, out->b, out->len);
+  }
+  free(matches);
+  return n;
+}
+
+// s/pattern/replacement/g on rows [from, to), any byte may stand for the
+// /. an empty pattern is the last one, and the new one becomes the last
+static void ed_substitute(char *arg, int from, int to) {
+  char delim = *arg;
+  if (delim == '\0') {
+    ed_set_commandmsg("E471: Argument required");
+    return;
+  }
+  if (isalnum((unsigned char)delim) || delim == '\\') {
+    ed_set_commandmsg(
+        "E146: Regular expressions can't be delimited by letters");
+    return;
+  }
+  char *pat = arg + 1;
+  char *rep = ed_cut_at(pat, delim);
+  char *flags = rep ? ed_cut_at(rep, delim) : NULL;
+  if (rep == NULL) rep = "";
+  if (flags == NULL) flags = "";
+  int global = 0;
+  for (; *flags; flags++) {
+    if (*flags != 'g') {
+      ed_set_commandmsg("E488: Trailing characters: %s", flags);
+      return;
+    }
+    global = 1;
+  }
+  int bad = ed_rep_bad_escape(rep);
+  if (bad) {
+    ed_set_commandmsg("\\%c is not supported in the replacement", bad);
+    return;
+  }
+  if (pat[0]) {
+    if (!ed_search_set(strdup(pat))) return;
+  } else if (editor.search.pattern == NULL) {
+    ed_set_commandmsg("E35: No previous regular expression");
+    return;
+  }
+
+  ed_load_rows(to);
+  if (to > editor.numrows) to = editor.numrows;
+  struct matcher *m = ed_matcher(&editor.search.matcher);
+  // empty matches are on rows the search below skips, like $ on all
+  int empty = rx_can_be_empty(m);
+  struct abuf out = ABUF_INIT;
+  out.b = malloc(out.cap);
+  int subs = 0;
+  int lines = 0;
+  int last = -1;
+  int r = from;
+  int end = from;
+  const char *span = NULL, *spanend = NULL;
+  while (r < to) {
+    if (!empty) {
+      // rows without a match are skipped a span at a time. replacing in
+      // a row leaves the rows after it in the span as they were, so the
+      // scan goes on in the same span
+      if (r >= end) {
+        end = ed_row_span(r, to, &span, &spanend);
+      } else {
+        span = ed_row(r)->string;
+      }
+      const char *hit = rx_find(m, span, span, spanend);
+      if (hit == NULL) {
+        r = end;
+        continue;
+      }
+      r = ed_hit_row(r, hit);
+    }
+    int n = ed_substitute_row(m, r, rep, global, empty, &out);
+    if (n) {
+      subs += n;
+      lines++;
+      last = r;
+    }
+    r++;
+  }
+  ab_free(&out);
+
+  if (subs == 0) {
+    ed_set_commandmsg("E486: Pattern not found: %s", editor.search.pattern);
+    return;
+  }
+  editor.cy = last;
+  editor.cx = editor.prev_cx = TEXT_START;
+  ed_set_commandmsg("%d substitution%s on %d line%s", subs,
+                    subs == 1 ? "" : "s", lines, lines == 1 ? "" : "s");
+}
+
+// :w, :q, :wq and :s, or :%s for all rows
+void ed_command() {
+  char *line = ed_prompt(":", NULL);
+  if (line == NULL) return;
+  char *cmd = line;
+  int all = *cmd == '%';
+  if (all) cmd++;
+  if (cmd[0] == 's' && !isalpha((unsigned char)cmd[1])) {
+    if (all) {
+      ed_substitute(cmd + 1, 0, INT_MAX);
+    } else if (CURRENT_ROW < editor.numrows) {
+      ed_substitute(cmd + 1, CURRENT_ROW, CURRENT_ROW + 1);
+    }
+  } else if (!all && strcmp(cmd, "w") == 0) {
+    ed_save();
+  } else if (!all && strcmp(cmd, "q") == 0) {
+    ed_quit();
+  } else if (!all && strcmp(cmd, "wq") == 0) {
+    ed_save();
+    ed_save_wait();
+    // a failed save leaves the rows dirty, stay to save them some other way
+    if (editor.dirty_row == INT_MAX) ed_quit();
+  } else {
+    ed_set_commandmsg("E492: Not an editor command: %s", line);
+  }
+  free(line);
+}
+
+/* registers */
+
+// a new store, strings are added to it before they are shared. when all
+// numbers are taken the last store takes them too
+static int ed_store_new() {
+  int id = 1;
+  while (id < editor.nstores && editor.stores[id].used) id++;
+  if (id == STORES_MAX) return id - 1;
+  if (id >= editor.nstores) {
+    int n = editor.nstores ? editor.nstores * 2 : 16;
+    if (n > STORES_MAX) n = STORES_MAX;
+    editor.stores = realloc(editor.stores, sizeof(struct store) * n);
+    if (editor.stores == NULL) die("realloc");
+    memset(&editor.stores[editor.nstores], 0,
+           sizeof(struct store) * (n - editor.nstores));
+    editor.nstores = n;
+  }
+  editor.stores[id].used = 1;
+  return id;
+}
+
+// the store frees p with the rest of its blocks
+static void ed_store_add(int id, char *p, int cap) {
+  struct store *st = &editor.stores[id];
+  if (st->nblocks == st->cap) {
+    st->cap = st->cap ? st->cap * 2 : 4;
+    st->blocks = realloc(st->blocks, sizeof(struct store_block) * st->cap);
+    if (st->blocks == NULL) die("realloc");
+  }
+  st->blocks[st->nblocks].p = p;
+  st->blocks[st->nblocks].cap = cap;
+  st->nblocks++;
+}
+
+static void ed_store_free(struct store *st) {
+  for (int i = 0; i < st->nblocks; i++) {
+    if (st->blocks[i].cap) {
+      ar_free(&editor.arena, st->blocks[i].p, st->blocks[i].cap);
+    } else {
+      free(st->blocks[i].p);
+    }
+  }
+  free(st->blocks);
+  memset(st, 0, sizeof(struct store));
+}
+
+// a row or register view stopped pointing into the store
+void ed_store_unref(int id) {
+  struct store *st = &editor.stores[id];
+  if (--st->refs == 0) ed_store_free(st);
+}
+
+// the rows of the register as views. a row owning its string hands it
+// over to the store and keeps viewing it until it is changed. a row
+// pointing into the map right after the span before it joins the span
+static void ed_reg_view(struct reg *rg, TextRow *row, int *store) {
+  struct reg_view *last = rg->nviews ? &rg->views[rg->nviews - 1] : NULL;
+  if (row->cap == 0 && row->store == 0 && last && last->store == 0) {
+    const char *end = last->string + last->size;
+    const char *p = end;
+    while (p < row->string && *p == '\r') p++;
+    if (p + 1 == row->string && *p == '\n' &&
+        row->string + row->size - last->string <= INT_MAX) {
+      last->size = row->string + row->size - last->string;
+      last->lines++;
+      return;
+    }
+  }
+  if (row->cap) {
+    if (*store == 0) *store = ed_store_new();
+    ed_store_add(*store, row->string, row->cap);
+    row->cap = 0;
+    row->store = *store;
+    editor.stores[*store].refs++;
+  }
+  struct reg_view *v = &rg->views[rg->nviews++];
+  v->string = row->string;
+  v->size = row->size;
+  v->lines = 1;
+  v->store = row->store;
+  if (v->store) editor.stores[v->store].refs++;
+}
+
+// v holds a copy of s[0, len)
+static void ed_reg_copy(struct reg_view *v, const char *s, int len,
+                        int *store) {
+  if (*store == 0) *store = ed_store_new();
+  char *copy = malloc(len + 1);
+  if (copy == NULL) die("malloc");
+  memcpy(copy, s, len);
+  ed_store_add(*store, copy, 0);
+  v->string = copy;
+  v->size = len;
+  v->store = *store;
+  editor.stores[*store].refs++;
+}
+
+static void ed_reg_drop(struct reg *rg) {
+  if (rg == NULL || --rg->refs > 0) return;
+  for (int i = 0; i < rg->nviews; i++) {
+    if (rg->views[i].store) ed_store_unref(rg->views[i].store);
+  }
+  free(rg->views);
+  free(rg);
+}
+
+// rows r1 to r2 go to the unnamed register and the one picked with ", or
+// the bytes from (r1, p1) up to (r2, p2) if not linewise. whole rows are
+// shared, so 5000000yy copies no text. the parts of rows at both ends of
+// a charwise yank are copied, d and c change those rows right away
+static void ed_yank(int r1, int p1, int r2, int p2, int linewise) {
+  struct reg *rg = malloc(sizeof(struct reg));
+  if (rg == NULL) die("malloc");
+  rg->refs = 0;
+  rg->nviews = 0;
+  rg->lines = r2 - r1 + 1;
+  rg->views = malloc(sizeof(struct reg_view) * rg->lines);
+  if (rg->views == NULL) die("malloc");
+  rg->linewise = linewise;
+  int store = 0;
+  for (int r = r1; r <= r2; r++) {
+    TextRow *row = ed_row(r);
+    if (linewise || (r > r1 && r < r2)) {
+      ed_reg_view(rg, row, &store);
+    } else {
+      int from = r == r1 ? p1 : 0;
+      int to = r == r2 ? p2 : row->size;
+      ed_reg_copy(&rg->views[rg->nviews++], &row->string[from], to - from,
+                  &store);
+      rg->views[rg->nviews - 1].lines = 1;
+    }
+  }
+  // spans left most of the views unused
+  if (rg->nviews < rg->lines) {
+    rg->views = realloc(rg->views, sizeof(struct reg_view) * rg->nviews);
+    if (rg->views == NULL) die("realloc");
+  }
+  int regs[] = {0, editor.reg};
+  for (int i = 0; i < (editor.reg ? 2 : 1); i++) {
+    ed_reg_drop(editor.regs[regs[i]]);
+    editor.regs[regs[i]] = rg;
+    rg->refs++;
+  }
+}
+
+// a new row viewing s[0, len) in store, copied when the row is changed
+static void ed_row_view(TextRow *row, char *s, int len, int store) {
+  row->size = len;
+  row->rsize = 0;
+  row->cap = row->rcap = row->hlcap = 0;
+  row->hl_open = LEX_STALE;
+  row->store = store;
+  row->string = s;
+  row->render = NULL;
+  row->hl = NULL;
+  if (store) editor.stores[store].refs++;
+  if (len) {
+    ed_journal(JR_INSERT, ed_row_index(row), 0, s, len);
+    ed_undo_log(JR_INSERT, ed_row_index(row), 0, s, len);
+  }
+}
+
+// fill rows with the rows of v, a span is split like the map is loaded
+static void ed_put_view(TextRow *rows, const struct reg_view *v) {
+  if (v->lines == 1) {
+    ed_row_view(rows, v->string, v->size, v->store);
+    return;
+  }
+  size_t pos = 0;
+  for (int i = 0; i < v->lines; i++) {
+    size_t len;
+    size_t next = ed_map_line(v->string, v->size, pos, &len);
+    ed_row_view(&rows[i], v->string + pos, len, v->store);
+    pos = next;
+  }
+}
+
+// register views pointing into the map from s on get a copy, before a
+// save overwrites that part of the file
+void ed_reg_own(const char *s) {
+  for (int i = 0; i < REGISTERS; i++) {
+    struct reg *rg = editor.regs[i];
+    int store = 0;
+    for (int k = 0; rg && k < rg->nviews; k++) {
+      struct reg_view *v = &rg->views[k];
+      if (v->store == 0 && v->string + v->size >= s)
+        ed_reg_copy(v, v->string, v->size, &store);
+    }
+  }
+}
+
+// empty the registers and free the stores, before the rows viewing them
+// are freed with the file
+void ed_reg_clear() {
+  for (int i = 0; i < REGISTERS; i++) {
+    ed_reg_drop(editor.regs[i]);
+    editor.regs[i] = NULL;
+  }
+  for (int id = 1; id < editor.nstores; id++) {
+    struct store *st = &editor.stores[id];
+    // small blocks are freed with the arena
+    for (int b = 0; b < st->nblocks; b++) {
+      if (st->blocks[b].cap > ARENA_MAX_BLOCK || st->blocks[b].cap == 0)
+        continue;
+      st->blocks[b--] = st->blocks[--st->nblocks];
+    }
+    ed_store_free(st);
+  }
+  free(editor.stores);
+  editor.stores = NULL;
+  editor.nstores = 0;
+}
+
+/* operators */
+
+// motions that take whole rows when they follow an operator
+static int ed_motion_linewise(int key) {
+  switch (key) {
+    case UP:
+    case DOWN:
+    case ENTER:
+    case GOTO_LINE_KEY:
+    case GOTO_KEY:
+    case PERCENT_KEY:
+    case CTRL_KEY('d'):
+    case CTRL_KEY('u'):
+    case CTRL_KEY('f'):
+    case CTRL_KEY('b'):
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// where the motion m goes from the cursor, as a row and a byte in it
+static void ed_motion_target(Motion *m, int *rpos, int *pos) {
+  int key = (unsigned char)m->motion[0];
+  *rpos = CURRENT_ROW;
+  *pos = ed_rx_to_pos(ed_row_rendered(CURRENT_ROW), CURRENT_COL);
+  if (key == WORD_NEXT_KEY || key == WORD_END_KEY || key == WORD_BACK_KEY) {
+    ed_word_move(key, m->n ? m->n : 1, rpos, pos);
+    return;
+  }
+  if (key == RIGHT) {
+    // l goes up to after the last byte, like x
+    long to = (long)*pos + (m->n ? m->n : 1);
+    *pos = to < ed_row(*rpos)->size ? to : ed_row(*rpos)->size;
+    return;
+  }
+  // move the cursor there and back
+  int cy = editor.cy, cx = editor.cx, prev_cx = editor.prev_cx;
+  int row_offset = editor.row_offset, col_offset = editor.col_offset;
+  ed_motion(m);
+  *rpos = CURRENT_ROW;
+  *pos = ed_rx_to_pos(ed_row_rendered(CURRENT_ROW), CURRENT_COL);
+  editor.cy = cy;
+  editor.cx = cx;
+  editor.prev_cx = prev_cx;
+  editor.row_offset = row_offset;
+  editor.col_offset = col_offset;
+}
+
+// d, c or y and the motion after it, or the operator again for whole
+// rows, like dw, c$, 3yy or d5G. count is the one typed before the
+// operator. what is between the cursor and the end of the motion is
+// yanked, then deleted at once for d and c. c goes on in insert mode
+void ed_operator(int op, int count) {
+  OperatorMotion om;
+  om.op = op;
+  int c = ed_read_key();
+  if (editor.numrows == 0) return;
+  int linewise;
+  int r1 = CURRENT_ROW, p1 = 0, r2, p2 = 0;
+  int motion = ed_read_motion(&c, &om.m);
+  // counts before and after the operator multiply, 2d3w is d6w
+  if (count && om.m.n) {
+    long n = (long)count * om.m.n;
+    om.m.n = n < INT_MAX ? n : INT_MAX;
+  } else if (count) {
+    om.m.n = count;
+  }
+  if (motion) {
+    int key = (unsigned char)om.m.motion[0];
+    TextRow *row = ed_row_rendered(r1);
+    p1 = ed_rx_to_pos(row, CURRENT_COL);
+    // cw changes up to the end of the word, like ce
+    if (op == CHANGE_OP_KEY && key == WORD_NEXT_KEY && p1 < row->size &&
+        ed_word_class(row->string[p1]) != 0)
+      key = om.m.motion[0] = WORD_END_KEY;
+    ed_motion_target(&om.m, &r2, &p2);
+    linewise = ed_motion_linewise(key);
+    // j or k that can't move does nothing
+    if (linewise && r2 == r1 && (key == UP || key == DOWN)) return;
+    if (r2 < r1 || (r2 == r1 && p2 < p1)) {
+      int r = r1, p = p1;
+      r1 = r2;
+      p1 = p2;
+      r2 = r;
+      p2 = p;
+    }
+    // e and $ take the byte they end on
+    if (key == WORD_END_KEY || key == LINE_END) {
+      if (p2 < ed_row(r2)->size) p2++;
+    }
+    // ending at the start of a row, or for dw only after blanks there,
+    // stops at the end of the row before
+    if (r2 > r1 && !linewise) {
+      TextRow *last = ed_row(r2);
+      int i =
+          key == WORD_NEXT_KEY ? ed_class_skip(last->string, 0, p2, 0) : 0;
+      if (i == p2) {
+        r2--;
+        p2 = ed_row(r2)->size;
+      }
+    }
+  } else if (c == op) {
+    linewise = 1;
+    long to = (long)r1 + (om.m.n ? om.m.n : 1) - 1;
+    ed_load_rows(to + 1 < INT_MAX ? to + 1 : INT_MAX);
+    r2 = to < editor.numrows ? to : editor.numrows - 1;
+  } else {
+    return;
+  }
+
+  ed_yank(r1, p1, r2, p2, linewise);
+  if (op == YANK_OP_KEY) {
+    if (!linewise) ed_cursor_to(r1, p1);
+    if (linewise && r2 - r1 + 1 > 2)
+      ed_set_commandmsg("%d lines yanked", r2 - r1 + 1);
+    to_normal_mode();
+  } else if (linewise && op == CHANGE_OP_KEY) {
+    // the first row stays, emptied
+    ed_delete_rows(r1 + 1, r2 - r1);
+    ed_row_truncate(ed_row(r1), 0);
+    editor.cy = r1;
+    editor.cx = TEXT_START;
+    to_insert_mode();
+  } else if (linewise) {
+    ed_delete_rows(r1, r2 - r1 + 1);
+    if (editor.numrows == 0) ed_insert_row(0, "", 0);
+    editor.cy = r1 < editor.numrows ? r1 : editor.numrows - 1;
+    editor.cx = ed_first_nonblank(CURRENT_ROW);
+    if (r2 - r1 + 1 > 2) ed_set_commandmsg("%d fewer lines", r2 - r1 + 1);
+    to_normal_mode();
+  } else {
+    TextRow *first = ed_row(r1);
+    if (r1 == r2) {
+      ed_row_delete(first, p1, p2 - p1);
+    } else {
+      // the rest of the last row joins the first one
+      TextRow *last = ed_row(r2);
+      ed_row_truncate(first, p1);
+      ed_row_insert_str(first, p1, &last->string[p2], last->size - p2);
+      ed_delete_rows(r1 + 1, r2 - r1);
+    }
+    ed_cursor_to(r1, p1);
+    if (op == CHANGE_OP_KEY) {
+      to_insert_mode();
+    } else {
+      to_normal_mode();
+    }
+  }
+  editor.prev_cx = editor.cx;
+  ed_update_rownum_width();
+}
+
+// p and P, put the register after or before the cursor count times.
+// rows are put as rows of their own after or before the current one
+void ed_put(int after, int count) {
+  struct reg *rg = editor.regs[editor.reg];
+  if (rg == NULL) return;
+  if (count <= 0) count = 1;
+  if (!rg->linewise) {
+    // rows joined by '\n', for ed_insert_text()
+    struct abuf ab = ABUF_INIT;
+    ab.b = malloc(ab.cap);
+    for (int k = 0; k < rg->nviews; k++) {
+      struct reg_view *v = &rg->views[k];
+      size_t pos = 0, len = v->size;
+      for (int i = 0; i < v->lines; i++) {
+        size_t next = v->lines > 1 ? ed_map_line(v->string, v->size, pos, &len)
+                                   : len;
+        if (k || i) ab_append(&ab, "\n", 1);
+        ab_append(&ab, v->string + pos, len);
+        pos = next;
+      }
+    }
+    if (ab.len == 0) {
+      ab_free(&ab);
+      return;
+    }
+    if (editor.numrows && after) {
+      int pos = ed_cursor_pos();
+      if (pos < ed_row(CURRENT_ROW)->size) pos++;
+      ed_cursor_to(CURRENT_ROW, pos);
+    }
+    for (int i = 0; i < count; i++) ed_insert_text(ab.b, ab.len);
+    ab_free(&ab);
+    // on the last byte put
+    int pos = ed_cursor_pos();
+    ed_cursor_to(CURRENT_ROW, pos > 0 ? pos - 1 : 0);
+    to_normal_mode();
+    editor.prev_cx = editor.cx;
+    return;
+  }
+
+  int lines = rg->lines;
+  if ((long)lines * count > INT_MAX - editor.numrows) return;
+  int rpos = editor.numrows ? CURRENT_ROW + after : 0;
+  // all rows are opened at once and view the strings of the register
+  TextRow *rows = ed_open_rows(rpos, lines * count);
+  for (int i = 0; i < count; i++) {
+    TextRow *row = &rows[i * lines];
+    for (int k = 0; k < rg->nviews; k++) {
+      ed_put_view(row, &rg->views[k]);
+      row += rg->views[k].lines;
+    }
+  }
+  editor.cy = rpos;
+  editor.cx = ed_first_nonblank(rpos);
+  editor.prev_cx = editor.cx;
+  ed_update_rownum_width();
+  if (lines * count > 2) ed_set_commandmsg("%d more lines", lines * count);
+}
+
+/* mode */
+
+void to_normal_mode() {
+  int max_size = MAX_CX(*ed_row_rendered(CURRENT_ROW));
+  // snap cursor at the last char
+  if (editor.cx > max_size) editor.cx = max_size;
+  editor.mode = NORMAL_MODE;
+}
+
+void to_insert_mode() { editor.mode = INSERT_MODE; }
+
+/* file I/O */
+
+// keep line numbers as wide as the largest one, cx and wincols
+// include the number column so they are shifted with it
+static void ed_update_rownum_width() {
+  char numbuf[12];
+  int width = snprintf(numbuf, sizeof(numbuf), "%d", editor.numrows);
+  int delta = width - editor.rownum_width;
+  if (delta == 0) return;
+  editor.rownum_width = width;
+  editor.cx += delta;
+  editor.prev_cx += delta;
+  editor.wincols -= delta;
+}
+
+// the line of map starting at pos, return where the next one starts
+static size_t ed_map_line(const char *map, size_t mapsize, size_t pos,
+                          size_t *linelen) {
+  const char *line = map + pos;
+  const char *nl = memchr(line, '\n', mapsize - pos);
+  if (nl == NULL) nl = map + mapsize;
+  pos = nl - map;
+  if (pos < mapsize) pos++;  // skip \n
+  // remove \r, a last line without \n is kept like getline does
+  *linelen = nl - line;
+  while (*linelen > 0 && line[*linelen - 1] == '\r') (*linelen)--;
+  return pos;
+}
+
+// loader thread, split the map line by line in chunks that double in
+// size, so the first screen is ready early and later chunks are cheap
+static void *ed_loader(void *arg) {
+  struct row_loader *ld = arg;
+  char *map = editor.map;
+  size_t mapsize = editor.mapsize;
+  size_t pos = 0;
+  int chunk = LOAD_CHUNK_MIN;
+  char cr = 0;
+  TextRow *rows = malloc(sizeof(TextRow) * LOAD_CHUNK_MAX);
+  if (rows == NULL) die("malloc");
+
+  while (pos < mapsize) {
+    int n = 0;
+    while (n < chunk && pos < mapsize) {
+      char *line = map + pos;
+      size_t linelen;
+      pos = ed_map_line(map, mapsize, pos, &linelen);
+      if (line + linelen < map + mapsize && line[linelen] == '\r') cr = 1;
+
+      TextRow *row = &rows[n++];
+      row->size = linelen;
+      row->rsize = row->rcap = 0;
+      row->cap = row->hlcap = 0;
+      row->hl_open = LEX_STALE;
+      row->store = 0;
+      row->string = line;
+      row->render = NULL;
+      row->hl = NULL;
+    }
+
+    pthread_mutex_lock(&ld->lock);
+    if (ld->stop) {
+      pthread_mutex_unlock(&ld->lock);
+      break;
+    }
+    if (ld->nrows + n > ld->cap) {
+      int cap = ld->cap ? ld->cap : LOAD_CHUNK_MAX;
+      while (cap < ld->nrows + n) cap *= 2;
+      ld->rows = realloc(ld->rows, sizeof(TextRow) * cap);
+      if (ld->rows == NULL) die("realloc");
+      ld->cap = cap;
+    }
+    memcpy(&ld->rows[ld->nrows], rows, sizeof(TextRow) * n);
+    ld->nrows += n;
+    ld->read = pos;
+    ld->cr = cr;
+    pthread_cond_signal(&ld->cond);
+    pthread_mutex_unlock(&ld->lock);
+    ed_wake();
+
+    if (chunk < LOAD_CHUNK_MAX) chunk *= 2;
+  }
+
+  pthread_mutex_lock(&ld->lock);
+  ld->done = 1;
+  pthread_cond_signal(&ld->cond);
+  pthread_mutex_unlock(&ld->lock);
+  ed_wake();
+  free(rows);
+  return NULL;
+}
+
+static void ed_load_start() {
+  struct row_loader *ld = &editor.load;
+  if (editor.mapsize == 0) return;
+  ld->rows = NULL;
+  ld->nrows = ld->cap = 0;
+  ld->read = 0;
+  ld->done = ld->stop = ld->cr = 0;
+  pthread_mutex_init(&ld->lock, NULL);
+  pthread_cond_init(&ld->cond, NULL);
+  editor.loading = 1;
+  if (pthread_create(&ld->thread, NULL, ed_loader, ld) != 0)
+    die("pthread_create");
+}
+
+// set offsets[k], k is at most noffsets
+static void ed_index_set(int k, size_t offset) {
+  if (k == editor.offsets_cap) {
+    editor.offsets_cap = editor.offsets_cap ? editor.offsets_cap * 2 : 64;
+    editor.offsets =
+        realloc(editor.offsets, sizeof(size_t) * editor.offsets_cap);
+    if (editor.offsets == NULL) die("realloc");
+  }
+  editor.offsets[k] = offset;
+  if (k == editor.noffsets) editor.noffsets++;
+}
+
+// append the rows split so far to editor.row,
+// return how many rows were published
+int ed_load_publish() {
+  struct row_loader *ld = &editor.load;
+  if (!editor.loading) return 0;
+
+  // take the whole staging buffer, the loader starts a new one
+  pthread_mutex_lock(&ld->lock);
+  TextRow *rows = ld->rows;
+  int n = ld->nrows;
+  char done = ld->done;
+  editor.mapread = ld->read;
+  editor.map_cr = ld->cr;
+  ld->rows = NULL;
+  ld->nrows = ld->cap = 0;
+  pthread_mutex_unlock(&ld->lock);
+
+  // the incremental search reads rows in the background
+  ed_incsearch_pause();
+  if (n) {
+    // the rows still point into the map, which gives their file offsets
+    int k = editor.noffsets;
+    int first = k * SAVE_INDEX_ROWS - editor.numrows;
+    for (int i = first; i >= 0 && i < n; i += SAVE_INDEX_ROWS) {
+      ed_index_set(k++, rows[i].string - editor.map);
+    }
+    ed_grow_gap(n);
+    ed_move_gap(editor.numrows);
+    memcpy(&editor.row[editor.numrows], rows, sizeof(TextRow) * n);
+    editor.gap += n;
+    editor.numrows += n;
+    ed_update_rownum_width();
+  }
+  free(rows);
+
+  if (done) {
+    pthread_join(ld->thread, NULL);
+    pthread_mutex_destroy(&ld->lock);
+    pthread_cond_destroy(&ld->cond);
+    editor.loading = 0;
+  }
+  ed_incsearch_resume();
+  return n;
+}
+
+// wait until there are at least n rows or the whole file is loaded,
+// only the part of the file in front of row n is waited for
+void ed_load_rows(int n) {
+  struct row_loader *ld = &editor.load;
+  while (editor.loading && editor.numrows < n) {
+    pthread_mutex_lock(&ld->lock);
+    while (ld->nrows == 0 && !ld->done) {
+      pthread_cond_wait(&ld->cond, &ld->lock);
+    }
+    pthread_mutex_unlock(&ld->lock);
+    ed_load_publish();
+  }
+}
+
+// map the whole file, or read it into the heap when it can't be mapped
+static void ed_map_file(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) die("fstat");
+
+  editor.map = NULL;
+  editor.mapsize = editor.mapread = 0;
+  editor.map_heap = 0;
+  editor.loading = 0;
+  editor.save.st = st;
+  editor.save.st_valid = S_ISREG(st.st_mode);
+  editor.save.map_is_file = 0;
+  if (S_ISREG(st.st_mode)) {
+    if (st.st_size == 0) return;
+    editor.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (editor.map != MAP_FAILED) {
+      editor.mapsize = st.st_size;
+      editor.save.map_is_file = 1;
+      return;
+    }
+    editor.map = NULL;
+  }
+
+  // pipes, devices, or file systems without mmap
+  size_t cap = 0;
+  ssize_t nread;
+  editor.map_heap = 1;
+  do {
+    if (editor.mapsize == cap) {
+      cap = cap ? cap * 2 : 4096;
+      editor.map = realloc(editor.map, cap);
+      if (editor.map == NULL) die("realloc");
+    }
+    nread = read(fd, editor.map + editor.mapsize, cap - editor.mapsize);
+    if (nread == -1 && errno != EINTR) die("read");
+    if (nread > 0) editor.mapsize += nread;
+  } while (nread != 0);
+}
+
+void ed_open(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+
+  free(editor.filename);
+  editor.filename = strdup(filename);
+
+  ed_map_file(fd);
+  close(fd);
+  editor.dirty_row = INT_MAX;
+  editor.noffsets = 0;
+  editor.map_cr = 0;
+  editor.syntax = ed_syntax_for(filename);
+  editor.hl_rows = 0;
+
+  // rows are split in the background, ed_refresh() waits for the first
+  // screen only
+  ed_update_rownum_width();
+  ed_load_start();
+
+  // move cursor after line number
+  editor.cy = 0;
+  editor.cx = editor.prev_cx = TEXT_START;
+
+  editor.file_opened = 1;
+  ed_journal_open();
+}
+
+// free everything that belongs to the opened file, row storage is
+// returned to the system in bulk
+void ed_close_file() {
+  if (!editor.file_opened) return;
+  ed_save_wait();
+  ed_journal_close();
+  ed_undo_clear();
+  ed_reg_clear();
+
+  if (editor.loading) {
+    pthread_mutex_lock(&editor.load.lock);
+    editor.load.stop = 1;
+    pthread_mutex_unlock(&editor.load.lock);
+    ed_load_rows(INT_MAX);
+  }
+
+  for (int i = 0; i < editor.numrows; i++) {
+    TextRow *row = ed_row(i);
+    if (row->cap > ARENA_MAX_BLOCK)
+      ar_free(&editor.arena, row->string, row->cap);
+    if (row->rcap > ARENA_MAX_BLOCK)
+      ar_free(&editor.arena, row->render, row->rcap);
+    if (row->hlcap > ARENA_MAX_BLOCK)
+      ar_free(&editor.arena, row->hl, row->hlcap);
+  }
+  ar_free_all(&editor.arena);
+  editor.rcache_len = 0;
+  editor.noffsets = 0;
+  editor.search.counted = 0;
+  free(editor.row);
+  editor.row = NULL;
+  editor.numrows = editor.rowcap = editor.gap = 0;
+
+  if (editor.map_heap) {
+    free(editor.map);
+  } else if (editor.map) {
+    munmap(editor.map, editor.mapsize);
+  }
+  editor.map = NULL;
+  editor.mapsize = editor.mapread = 0;
+  editor.file_opened = 0;
+}
+
+void ed_quit() {
+  ed_close_file();
+  ed_clear();
+  exit(0);
+}
+
+// CTRL-G, file name and line count, followed by row allocator counters
+void ed_show_fileinfo() {
+  struct arena *ar = &editor.arena;
+  ed_set_commandmsg(
+      "\"%s\" %d lines | rows %zuK, wasted %zuK, %ld allocs | frame %dB",
+      editor.filename ? editor.filename : "[No Name]", editor.numrows,
+      ar->allocated / 1024, (ar->reserved - ar->allocated) / 1024, ar->calls,
+      editor.frame_bytes);
+}
+
+// flush the directory entry of a renamed file. dir is worked out before
+// fork(2), the child must not allocate
+static void ed_sync_dir(const char *dir) {
+  int fd = open(dir, O_RDONLY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+// write iov[0, n) holding len bytes, resuming after short writes
+static int ed_writev_all(int fd, struct iovec *iov, int n, size_t len) {
+  while (len > 0) {
+    ssize_t nwritten = writev(fd, iov, n);
+    if (nwritten == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    len -= nwritten;
+    // skip what was written, a short write can stop inside a row
+    while (n > 0 && (size_t)nwritten >= iov->iov_len) {
+      nwritten -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + nwritten;
+      iov->iov_len -= nwritten;
+    }
+  }
+  return 0;
+}
+
+// write rows [from, to) to fd, each followed by '\n'. rows are handed to
+// writev(2) straight from their strings, SAVE_IOV rows at a time
+static int ed_write_rows(int fd, int from, int to, size_t *written) {
+  struct iovec iov[SAVE_IOV * 2];
+  while (from < to) {
+    int n = 0;
+    size_t len = 0;
+    for (; from < to && n < SAVE_IOV * 2; from++) {
+      TextRow *row = ed_row(from);
+      iov[n].iov_base = row->string;
+      iov[n++].iov_len = row->size;
+      iov[n].iov_base = "\n";
+      iov[n++].iov_len = 1;
+      len += row->size + 1;
+    }
+    if (ed_writev_all(fd, iov, n, len) == -1) return -1;
+    *written += len;
+  }
+  return 0;
+}
+
+// write up to maxrows lines of the map from *pos on, the part the loader
+// has not published yet, as they would be saved once loaded
+static int ed_write_map(int fd, size_t *pos, int maxrows, int *rows,
+                        size_t *written) {
+  struct iovec iov[SAVE_IOV * 2];
+  while (*pos < editor.mapsize && maxrows > 0) {
+    int n = 0;
+    size_t len = 0;
+    for (; *pos < editor.mapsize && maxrows > 0 && n < SAVE_IOV * 2;
+         maxrows--) {
+      size_t linelen;
+      iov[n].iov_base = editor.map + *pos;
+      *pos = ed_map_line(editor.map, editor.mapsize, *pos, &linelen);
+      iov[n++].iov_len = linelen;
+      iov[n].iov_base = "\n";
+      iov[n++].iov_len = 1;
+      len += linelen + 1;
+      (*rows)++;
+    }
+    if (ed_writev_all(fd, iov, n, len) == -1) return -1;
+    *written += len;
+  }
+  return 0;
+}
+
+static void ed_save_report(int out, struct save_report *rep) {
+  if (write(out, rep, sizeof(*rep)) != sizeof(*rep)) {
+    // the editor is gone, the save goes on
+  }
+}
+
+// write rows from `from` on, and the rows still in the map, reporting
+// to out every SAVE_REPORT_ROWS rows
+static int ed_save_rows(int fd, int from, struct save_report *rep, int out) {
+  // rows not loaded yet are counted by their bytes in the map
+  size_t total = editor.mapsize - editor.mapread;
+  for (int i = from; i < editor.numrows; i++) total += ed_row(i)->size + 1;
+
+  int err = 0;
+  while (!err && from < editor.numrows) {
+    int to = from + SAVE_REPORT_ROWS;
+    if (to > editor.numrows) to = editor.numrows;
+    err = ed_write_rows(fd, from, to, &rep->bytes);
+    rep->rows += to - from;
+    rep->percent = total ? rep->bytes * 100 / total : 100;
+    ed_save_report(out, rep);
+    from = to;
+  }
+  size_t pos = editor.mapread;
+  while (!err && pos < editor.mapsize) {
+    err = ed_write_map(fd, &pos, SAVE_REPORT_ROWS, &rep->rows, &rep->bytes);
+    rep->percent = total ? rep->bytes * 100 / total : 100;
+    ed_save_report(out, rep);
+  }
+  return err;
+}
+
+// finish the save, fd is closed either way
+static int ed_save_close(int fd, int err, struct save_report *rep) {
+  if (err == 0) err = fsync(fd);
+  int saved = errno;
+  if (close(fd) == -1 && err == 0) {
+    err = -1;
+    saved = errno;
+  }
+  if (err) rep->err = saved;
+  return err;
+}
+
+// runs in the forked child, which sees the rows as they were at fork(2)
+// however they are edited meanwhile. they are written to tmp, which is
+// renamed over path once it is on disk, so a failed save leaves the file
+// as it was
+static void ed_save_snapshot(const char *path, char *tmp, const char *dir,
+                             int out) {
+  struct save_report rep = {0, 0, 0, 0, 0};
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    rep.err = errno;
+    rep.done = 1;
+    ed_save_report(out, &rep);
+    return;
+  }
+
+  struct stat st;
+  // keep the mode and owner of the file, mkstemp(3) makes it 0600
+  if (stat(path, &st) == 0) {
+    fchmod(fd, st.st_mode & 07777);
+    if (fchown(fd, st.st_uid, st.st_gid) == -1) {
+      // saved as the current user
+    }
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+  }
+
+  int err = ed_save_rows(fd, 0, &rep, out);
+  err = ed_save_close(fd, err, &rep);
+  if (err == 0 && rename(tmp, path) == -1) {
+    err = -1;
+    rep.err = errno;
+  }
+  if (err) {
+    unlink(tmp);
+  } else {
+    ed_sync_dir(dir);
+  }
+  rep.done = 1;
+  ed_save_report(out, &rep);
+}
+
+// runs in the forked child like ed_save_snapshot(), but only rewrites the
+// file from row from on, which starts at offset, and cuts off the rest
+static void ed_save_tail(const char *path, int from, size_t offset, int out) {
+  struct save_report rep = {0, 0, 0, 0, 0};
+  int fd = open(path, O_WRONLY);
+  if (fd == -1 || lseek(fd, offset, SEEK_SET) == -1) {
+    rep.err = errno;
+  } else {
+    int err = ed_save_rows(fd, from, &rep, out);
+    if (err == 0) err = ftruncate(fd, offset + rep.bytes);
+    ed_save_close(fd, err, &rep);
+  }
+  rep.done = 1;
+  ed_save_report(out, &rep);
+}
+
+// first row an incremental save has to write, -1 if the whole file has to
+// be written
+static int ed_save_from(const char *path) {
+  struct stat st;
+  struct stat *last = &editor.save.st;
+  if (!editor.save.incremental || !editor.save.st_valid || editor.map_cr)
+    return -1;
+  // changed by someone else
+  if (stat(path, &st) == -1 || st.st_ino != last->st_ino ||
+      st.st_dev != last->st_dev || st.st_size != last->st_size ||
+      st.st_mtim.tv_sec != last->st_mtim.tv_sec ||
+      st.st_mtim.tv_nsec != last->st_mtim.tv_nsec)
+    return -1;
+
+  // the row before the first changed one is written again, in case it
+  // was the last line and had no '\n'
+  int from = editor.dirty_row < editor.numrows ? editor.dirty_row
+                                               : editor.numrows;
+  if (from > 0) from--;
+  // all of it is better written to a new file
+  return from > 0 ? from : -1;
+}
+
+// update offsets for the rows as the save about to start writes them,
+// from the last entry in front of row from. return the offset of row from
+static size_t ed_index_rows(int from) {
+  if (editor.noffsets == 0) ed_index_set(0, 0);
+  int k = from / SAVE_INDEX_ROWS;
+  if (k >= editor.noffsets) k = editor.noffsets - 1;
+  editor.noffsets = k + 1;
+  size_t offset = editor.offsets[k];
+  size_t start = 0;
+  int i;
+  for (i = k * SAVE_INDEX_ROWS; i < editor.numrows; i++) {
+    if (i == from) start = offset;
+    if (i % SAVE_INDEX_ROWS == 0) ed_index_set(i / SAVE_INDEX_ROWS, offset);
+    offset += ed_row(i)->size + 1;
+  }
+  return i == from ? offset : start;
+}
+
+// save in a forked child so editing goes on while the file is written,
+// the child reports back through editor.save.fd
+void ed_save() {
+  if (!editor.file_opened) return;
+  // saved again when the running save is done, with the rows as they
+  // are by then
+  if (editor.save.pid) {
+    editor.save.again = 1;
+    return;
+  }
+
+  // write through symlinks instead of replacing them
+  char *path = realpath(editor.filename, NULL);
+  if (path == NULL) path = strdup(editor.filename);
+  int pathlen = strlen(path);
+  char *tmp = malloc(pathlen + sizeof(SAVE_TMP_SUFFIX));
+  memcpy(tmp, path, pathlen);
+  memcpy(tmp + pathlen, SAVE_TMP_SUFFIX, sizeof(SAVE_TMP_SUFFIX));
+  char *slash = strrchr(path, '/');
+  char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+
+  size_t offset = 0;
+  int from = -1;
+  if (editor.save.incremental) {
+    // offsets are only known for loaded rows
+    ed_load_rows(INT_MAX);
+    from = ed_save_from(path);
+    offset = ed_index_rows(from > 0 ? from : 0);
+    // rows still pointing into the part of the file about to be
+    // overwritten need their own copy first
+    if (from > 0 && editor.save.map_is_file) {
+      for (int i = from; i < editor.numrows; i++) {
+        TextRow *row = ed_row(i);
+        if (row->cap == 0 && row->store == 0) ed_row_own(row);
+      }
+      ed_undo_own(editor.map + offset);
+      ed_reg_own(editor.map + offset);
+    }
+  }
+
+  int pfd[2];
+  pid_t pid = -1;
+  if (pipe(pfd) == 0) {
+    pid = fork();
+    if (pid == 0) {
+      // only this thread lives on in the child, it must not wake the
+      // editor or touch the terminal
+      signal(SIGWINCH, SIG_DFL);
+      close(pfd[0]);
+      if (from >= 0) {
+        ed_save_tail(path, from, offset, pfd[1]);
+      } else {
+        ed_save_snapshot(path, tmp, dir, pfd[1]);
+      }
+      _exit(0);
+    }
+    close(pfd[1]);
+    if (pid == -1) close(pfd[0]);
+  }
+  free(dir);
+  free(tmp);
+  free(path);
+  if (pid == -1) {
+    editor.noffsets = 0;
+    ed_set_commandmsg("can't save! %s", strerror(errno));
+    return;
+  }
+
+  fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+  fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+  editor.save.pid = pid;
+  editor.save.fd = pfd[0];
+  editor.save.again = 0;
+  editor.save.done = 0;
+  editor.save.from = from > 0 ? from : 0;
+  // edits from now on are not in this save
+  editor.dirty_row = INT_MAX;
+  ed_journal_mark();
+  ed_set_commandmsg("\"%s\" saving", editor.filename);
+}
+
+// the running save is over
+static void ed_save_done(int ok) {
+  editor.save.st_valid = 0;
+  if (!ok) {
+    // the file is unknown now, the next save writes all of it
+    ed_mark_dirty(0);
+    editor.noffsets = 0;
+    return;
+  }
+  if (editor.save.from == 0) editor.save.map_is_file = 0;  // renamed over
+  char *path = realpath(editor.filename, NULL);
+  if (path && stat(path, &editor.save.st) == 0) editor.save.st_valid = 1;
+  free(path);
+  // the journal left is begun on the file as it is now
+  ed_journal_saved();
+}
+
+// read reports of the running save, called when editor.save.fd is readable
+void ed_save_poll() {
+  struct save_report reps[16];
+  ssize_t nread;
+  while ((nread = read(editor.save.fd, reps, sizeof(reps))) > 0) {
+    struct save_report *rep = &reps[nread / sizeof(*rep) - 1];
+    if (rep->done) {
+      editor.save.done = 1;
+      ed_save_done(rep->err == 0);
+      if (rep->err) {
+        ed_set_commandmsg("can't save! I/O error: %s", strerror(rep->err));
+      } else if (editor.save.from) {
+        ed_set_commandmsg("%dL, %zuC written from line %d", rep->rows,
+                          rep->bytes, editor.save.from + 1);
+      } else {
+        ed_set_commandmsg("%dL, %zuC written", rep->rows, rep->bytes);
+      }
+    } else {
+      ed_set_commandmsg("\"%s\" saving %d%%", editor.filename, rep->percent);
+    }
+  }
+  if (nread == -1 && (errno == EAGAIN || errno == EINTR)) return;
+
+  // the child is done
+  close(editor.save.fd);
+  waitpid(editor.save.pid, NULL, 0);
+  if (!editor.save.done) {
+    ed_save_done(0);
+    ed_set_commandmsg("can't save! the save was killed");
+  }
+  editor.save.fd = -1;
+  editor.save.pid = 0;
+  if (editor.save.again) ed_save();
+}
+
+// wait for the running save, and one asked for meanwhile
+void ed_save_wait() {
+  while (editor.save.pid) {
+    struct pollfd fd = {editor.save.fd, POLLIN, 0};
+    if (poll(&fd, 1, -1) == -1 && errno != EINTR) break;
+    ed_save_poll();
+  }
+}
+
+/* journal */
+
+// .name.swp next to the file, like vim
+static char *ed_journal_path(const char *filename) {
+  const char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  char *path = malloc(strlen(filename) + sizeof(JOURNAL_SUFFIX) + 1);
+  if (path == NULL) die("malloc");
+  memcpy(path, filename, dirlen);
+  sprintf(path + dirlen, ".%s%s", filename + dirlen, JOURNAL_SUFFIX);
+  return path;
+}
+
+// the header of a journal of the file as it was last read or written
+static struct journal_head ed_journal_head() {
+  struct journal_head head;
+  struct stat *st = &editor.save.st;
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+  if (editor.save.st_valid) {
+    head.ino = st->st_ino;
+    head.size = st->st_size;
+    head.mtime_sec = st->st_mtim.tv_sec;
+    head.mtime_nsec = st->st_mtim.tv_nsec;
+  }
+  return head;
+}
+
+// record a row op, called from the row ops. the journal file is created
+// on the first edit
+void ed_journal(int op, int row, int pos, const char *s, int len) {
+  struct journal *jr = &editor.journal;
+  if (!editor.file_opened || jr->off || jr->replaying) return;
+  struct journal_op rec = {op, row, pos, len};
+  ab_append(&jr->buf, (char *)&rec, sizeof(rec));
+  if (op == JR_INSERT) ab_append(&jr->buf, s, len);
+  // bulk edits like undoing a large delete don't pile up in memory
+  if (jr->buf.len >= JOURNAL_FLUSH_BYTES) ed_journal_flush();
+}
+
+static void ed_journal_fail(const char *what) {
+  struct journal *jr = &editor.journal;
+  ed_set_commandmsg("%s %s: %s, edits are not journaled", what, jr->path,
+                    strerror(errno));
+  if (jr->fd != -1) close(jr->fd);
+  jr->fd = -1;
+  jr->off = 1;
+  jr->unsynced = 0;
+}
+
+static int ed_write_all(int fd, const char *s, size_t len) {
+  while (len > 0) {
+    ssize_t nwritten = write(fd, s, len);
+    if (nwritten == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    s += nwritten;
+    len -= nwritten;
+  }
+  return 0;
+}
+
+// write the records made since the last flush
+void ed_journal_flush() {
+  struct journal *jr = &editor.journal;
+  if (jr->buf.len == 0 || jr->off) return;
+  if (jr->fd == -1) {
+    jr->fd = open(jr->path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (jr->fd == -1) {
+      ed_journal_fail("can't create");
+      return;
+    }
+    fcntl(jr->fd, F_SETFD, FD_CLOEXEC);
+    jr->written = 0;
+    struct journal_head head = ed_journal_head();
+    if (ed_write_all(jr->fd, (char *)&head, sizeof(head)) == 0)
+      jr->written = sizeof(head);
+  }
+  if (jr->written == 0 ||
+      ed_write_all(jr->fd, jr->buf.b, jr->buf.len) == -1) {
+    ed_journal_fail("can't write");
+    return;
+  }
+  jr->written += jr->buf.len;
+  jr->buf.len = 0;
+  jr->unsynced = 1;
+  jr->write_time = ed_now_ms();
+}
+
+// fsync the journal once the editor has been idle for JOURNAL_SYNC_MS
+void ed_journal_sync() {
+  struct journal *jr = &editor.journal;
+  if (!jr->unsynced || ed_now_ms() - jr->write_time < JOURNAL_SYNC_MS) return;
+  if (fdatasync(jr->fd) == -1) {
+    ed_journal_fail("can't sync");
+    return;
+  }
+  jr->unsynced = 0;
+}
+
+// a save is starting, edits from now on are not in it
+void ed_journal_mark() {
+  ed_journal_flush();
+  editor.journal.save_pos = editor.journal.written;
+}
+
+// the save started at the last ed_journal_mark() is on disk, keep only
+// the records made since then. the journal goes away if there are none
+void ed_journal_saved() {
+  struct journal *jr = &editor.journal;
+  ed_journal_flush();
+  jr->recover = 0;
+  if (jr->fd == -1) return;
+  if (jr->save_pos == jr->written) {
+    close(jr->fd);
+    unlink(jr->path);
+    jr->fd = -1;
+    jr->unsynced = 0;
+    return;
+  }
+
+  // the records after save_pos go to a new journal, renamed over the old.
+  // it is begun on the file just saved
+  struct journal_head head = ed_journal_head();
+  size_t len = jr->written - jr->save_pos;
+  char *tail = malloc(len);
+  char *tmp = malloc(strlen(jr->path) + 2);
+  sprintf(tmp, "%s~", jr->path);
+  int fd = -1;
+  if (tail && pread(jr->fd, tail, len, jr->save_pos) == (ssize_t)len)
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd != -1 && ed_write_all(fd, (char *)&head, sizeof(head)) == 0 &&
+      ed_write_all(fd, tail, len) == 0 && fdatasync(fd) == 0 &&
+      rename(tmp, jr->path) == 0) {
+    close(jr->fd);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    jr->fd = fd;
+    jr->written = sizeof(head) + len;
+    jr->unsynced = 0;
+  } else if (fd != -1) {
+    // keep the old journal, it is still right for the old file
+    close(fd);
+    unlink(tmp);
+  }
+  free(tmp);
+  free(tail);
+}
+
+// -r, apply the edits of the journal to the file just opened. edits
+// after that are appended to the same journal
+static void ed_journal_replay() {
+  struct journal *jr = &editor.journal;
+  jr->fd = open(jr->path, O_RDWR | O_APPEND);
+  if (jr->fd == -1) {
+    ed_set_commandmsg("no journal %s to recover", jr->path);
+    return;
+  }
+  fcntl(jr->fd, F_SETFD, FD_CLOEXEC);
+
+  struct stat st;
+  char *data = NULL;
+  size_t size = 0;
+  if (fstat(jr->fd, &st) == 0 && (data = malloc(st.st_size + 1)) != NULL) {
+    ssize_t nread;
+    while (size < (size_t)st.st_size &&
+           (nread = pread(jr->fd, data + size, st.st_size - size, size)) > 0)
+      size += nread;
+  }
+  if (size < sizeof(struct journal_head) ||
+      memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+    free(data);
+    errno = EINVAL;
+    ed_journal_fail("can't recover");
+    return;
+  }
+  // the edits are only right on top of the file they were made to. it
+  // was saved since, or changed by someone else
+  struct journal_head head = ed_journal_head();
+  if (memcmp(data, &head, sizeof(head)) != 0) {
+    free(data);
+    close(jr->fd);
+    jr->fd = -1;
+    jr->off = 1;
+    ed_set_commandmsg("%s is for another version of the file, not recovered",
+                      jr->path);
+    return;
+  }
+
+  // row numbers in the journal count all rows of the file
+  ed_load_rows(INT_MAX);
+  jr->replaying = 1;
+  size_t pos = sizeof(head);
+  int edits = 0;
+  int maxrows = editor.numrows;
+  struct journal_op rec;
+  while (pos + sizeof(rec) <= size) {
+    memcpy(&rec, data + pos, sizeof(rec));
+    size_t reclen = sizeof(rec) + (rec.op == JR_INSERT ? rec.len : 0);
+    // a record cut short by the crash, or garbage
+    if (rec.len < 0 || pos + reclen > size) break;
+    if (rec.row < 0 || rec.row > editor.numrows) break;
+    if (rec.row == editor.numrows && rec.op != JR_INSERT_ROWS) break;
+
+    TextRow *row = ed_row(rec.row);
+    if (rec.op == JR_INSERT) {
+      ed_row_insert_str(row, rec.pos, data + pos + sizeof(rec), rec.len);
+    } else if (rec.op == JR_DELETE) {
+      ed_row_delete(row, rec.pos, rec.len);
+    } else if (rec.op == JR_INSERT_ROWS && rec.pos > 0 &&
+               rec.pos <= INT_MAX - editor.numrows &&
+               (size_t)rec.pos <= maxrows + (size - pos)) {
+      // a count past the most rows the file has had plus one per byte
+      // left in the journal is garbage, not worth allocating for
+      TextRow *rows = ed_open_rows(rec.row, rec.pos);
+      for (int i = 0; i < rec.pos; i++) ed_row_init(&rows[i], "", 0);
+    } else if (rec.op == JR_DELETE_ROW &&
+               rec.len <= editor.numrows - rec.row) {
+      ed_delete_rows(rec.row, rec.len ? rec.len : 1);
+    } else {
+      break;
+    }
+    if (editor.numrows > maxrows) maxrows = editor.numrows;
+    pos += reclen;
+    edits++;
+  }
+  jr->replaying = 0;
+  free(data);
+  ed_update_rownum_width();
+
+  // new records go after the last good one
+  if (pos < size && ftruncate(jr->fd, pos) == -1) {
+    ed_journal_fail("can't write");
+    return;
   }
+  jr->written = pos;
+  ed_set_commandmsg("recovered %d edits from %s", edits, jr->path);
+}
+
+// set up the journal of the file just opened. a journal left by another
+// session is not touched unless recovering with -r
+void ed_journal_open() {
+  struct journal *jr = &editor.journal;
+  free(jr->path);
+  jr->path = ed_journal_path(editor.filename);
+  jr->fd = -1;
+  jr->buf.len = 0;
+  jr->written = jr->save_pos = 0;
+  jr->unsynced = jr->off = jr->replaying = 0;
+  if (jr->recover) {
+    ed_journal_replay();
+  } else if (access(jr->path, F_OK) == 0) {
+    jr->off = 1;
+    ed_set_commandmsg("found %s, start with -r to recover it", jr->path);
+  }
+}
+
+// the file is closed without saving, its edits are thrown away. a
+// recovered journal is kept until it is saved
+void ed_journal_close() {
+  struct journal *jr = &editor.journal;
+  if (jr->fd == -1) return;
+  close(jr->fd);
+  if (!jr->recover) unlink(jr->path);
+  jr->fd = -1;
+  jr->unsynced = 0;
+}
+
+/* init */
+
+void init_editor() {
+  enable_raw_mode();
+  init_wakeup();
+
+  editor.cx = editor.cy = 0;
+  editor.rx = 0;
+  editor.mode = NORMAL_MODE;
+  editor.numrows = 0;
+  editor.row = NULL;
+  editor.rowcap = editor.gap = 0;
+  editor.row_offset = editor.col_offset = 0;
+  editor.filename = NULL;
+  editor.file_opened = 0;
+  editor.map = NULL;
+  editor.mapsize = editor.mapread = 0;
+  editor.map_heap = 0;
+  editor.loading = 0;
+  editor.save.pid = 0;
+  editor.save.fd = -1;
+  editor.save.incremental = 0;
+  editor.save.st_valid = editor.save.map_is_file = 0;
+  struct abuf buf = ABUF_INIT;
+  editor.journal.buf = buf;
+  editor.journal.buf.b = malloc(buf.cap);
+  editor.journal.path = NULL;
+  editor.journal.fd = -1;
+  editor.journal.unsynced = editor.journal.off = 0;
+  editor.journal.replaying = editor.journal.recover = 0;
+  memset(&editor.undo, 0, sizeof(editor.undo));
+  memset(editor.regs, 0, sizeof(editor.regs));
+  editor.reg = 0;
+  editor.stores = NULL;
+  editor.nstores = 0;
+  editor.undo.limit = (size_t)UNDO_LIMIT_MB << 20;
+  struct arena arena = ARENA_INIT;
+  editor.arena = arena;
+  editor.rcache = NULL;
+  editor.rcache_len = editor.rcache_cap = 0;
+  editor.dirty_row = INT_MAX;
+  editor.offsets = NULL;
+  editor.noffsets = editor.offsets_cap = 0;
+  editor.map_cr = 0;
+  editor.syntax = NULL;
+  editor.hl_rows = 0;
+  editor.rownum_width = 0;
+
+  editor.commandmsg[0] = '\0';
+  editor.commandmsg_time = 0;
+  struct abuf prompt = ABUF_INIT;
+  editor.prompt = prompt;
+  editor.prompt.b = malloc(prompt.cap);
+  editor.prompting = 0;
+  editor.search.pattern = NULL;
+  editor.search.len = 0;
+  editor.search.dir = 1;
+  editor.search.re = NULL;
+  editor.search.gen = 0;
+  rx_matcher_init(&editor.search.matcher, NULL, 0);
+  editor.search.counts = NULL;
+  editor.search.counts_cap = editor.search.counted = 0;
+  editor.search.index = 0;
+  editor.pool.nthreads = -1;
+  editor.incsearch.started = 0;
+  editor.incsearch.re = NULL;
+  editor.incsearch.gen = 0;
+  rx_matcher_init(&editor.incsearch.draw, NULL, 0);
+  editor.incsearch.row = -1;
+
+  editor.screen = editor.frame = NULL;
+  editor.screen_lines = 0;
+  editor.screen_valid = 0;
+  editor.screen_row_offset = editor.screen_text_start = 0;
+  editor.frame_bytes = 0;
+  editor.frame_time = 0;
+
+  if (get_winsize(&editor.winrows, &editor.wincols) == -1) die("get_winsize");
+
+  ed_set_commandmsg("type <CTRL-Q> to quit");
+}
+
+static inline void init_rowcol() {
+  // last 2 row draw as status bar
+  editor.winrows -= 2;
+  // first some cols display as line number
+  editor.wincols -= TEXT_START;
+}
 
+int main(int argc, char const *argv[]) {
+  init_editor();
+  // before ed_open(), which widens the line numbers as rows are split
   init_rowcol();
 
+  int opt;
+  while ((opt = getopt(argc, (char *const *)argv, "iru:")) != -1) {
+    switch (opt) {
+      case 'i':
+        // save only what changed, in place
+        editor.save.incremental = 1;
+        break;
+      case 'r':
+        // replay the journal left by a crash
+        editor.journal.recover = 1;
+        break;
+      case 'u': {
+        // memory cap of the undo log in MB
+        char *end;
+        errno = 0;
+        long mb = strtol(optarg, &end, 10);
+        if (end == optarg || *end || errno || mb < 0 ||
+            (unsigned long)mb > SIZE_MAX >> 20) {
+          println("Usage: %s [-i] [-r] [-u MB] <filename>", argv[0]);
+          exit(0);
+        }
+        editor.undo.limit = (size_t)mb << 20;
+      } break;
+      default:
+        println("Usage: %s [-i] [-r] [-u MB] <filename>", argv[0]);
+        exit(0);
+    }
+  }
+
+  if (optind == argc) {
+    // show welcome message
+  } else if (optind == argc - 1) {
+    ed_open(argv[optind]);
+  } else {
+    println("Usage: %s [-i] [-r] [-u MB] <filename>", argv[0]);
+    exit(0);
+  }
+
   while (1) {
     ed_refresh();
-    ed_process_keypress();
+    // keys already waiting, like a paste or typeahead, are all handled
+    // before the next frame. while they keep coming a frame is still
+    // drawn every FRAME_MS
+    do {
+      ed_process_keypress();
+    } while (ed_input_pending() && ed_now_ms() - editor.frame_time < FRAME_MS);
   }
 
   return 0;
@@ -27,53 +27,132 @@ struct abuf {
 void ab_append(struct abuf *ab, const char *s, int len);
 void ab_free(struct abuf *ab);
 
+/* row allocator */
+// row strings and renders are carved from slabs in power of two size
+// classes, blocks bigger than the largest class come from malloc
+#define ARENA_MIN_SHIFT 4
+#define ARENA_MAX_SHIFT 12
+#define ARENA_CLASSES (ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1)
+#define ARENA_MAX_BLOCK (1 << ARENA_MAX_SHIFT)
+#define ARENA_SLAB (64 * 1024)
+#define ARENA_HEADER 16  // slab link, keeps blocks 16 bytes aligned
+struct arena {
+  char *slabs;                // linked through their first word
+  char *free[ARENA_CLASSES];  // free blocks linked through their first word
+  char *top;                  // unused tail of the newest slab
+  size_t left;
+  size_t reserved;   // bytes taken from malloc
+  size_t allocated;  // bytes handed out, reserved - allocated is wasted
+  long calls;        // blocks handed out
+};
+
+#define ARENA_INIT \
+  { NULL, {NULL}, NULL, 0, 0, 0, 0 }
+
+void *ar_alloc(struct arena *ar, int size, int *cap);
+void ar_free(struct arena *ar, void *p, int cap);
+void ar_free_all(struct arena *ar);
+
 /* terminal */
 void die(const char *msg);
 void disable_raw_mode();
 void disable_raw_mode();
+void ed_wake();
+void ed_wait_input();
+int ed_input_pending();
+void ed_read_paste(struct abuf *ab);
 inline int ed_read_key();
 inline void ed_move_cursor2(struct abuf *ab, win_size_t x, win_size_t y);
 int get_winsize(win_size_t *rows, win_size_t *cols);
 int get_cursor_pos(win_size_t *rows, win_size_t *cols);
 
 /* input */
-inline void ed_process_move(int key);
+inline void ed_process_move(int key, int n);
 inline void ed_normal_process(int key);
 inline void ed_insert_process(int key);
 inline void ed_process_keypress();
+char *ed_prompt(const char *prefix, void (*callback)(const char *, int));
 
 /* output */
 inline int println(const char *fmt, ...);
-inline void ed_draw_rows(struct abuf *ab);
+inline void ed_draw_rows(struct abuf *lines);
 inline void ed_draw_statusbar(struct abuf *ab);
 inline void ed_draw_commandbar(struct abuf *ab);
 inline void ed_set_commandmsg(const char *fmt, ...);
 inline void ed_clear();
 inline void ed_refresh();
+long ed_now_ms();
 inline void ed_scroll();
 
 /* row ops */
 inline void ed_render_row(TextRow *row);
+void ed_rcache_evict();
 inline void ed_insert_row(int row_pos, char *s, size_t len);
+void ed_row_insert_str(TextRow *row, int pos, const char *s, int len);
 inline void ed_delete_row(int row_pos);
+void ed_delete_rows(int rpos, int n);
 inline void ed_free_row();
 inline void ed_joinstr2row(TextRow *row, char *s, size_t len);
 inline void ed_row_insert_char(TextRow *row, int pos, int c);
 inline void ed_row_delete_char(TextRow *row, int pos);
+void ed_row_delete(TextRow *row, int pos, int len);
+void ed_row_truncate(TextRow *row, int pos);
 
 /* edit ops */
 inline void ed_insert_char(int c);
 inline void ed_insert_newline(int after);
+void ed_insert_text(const char *s, int len);
+void ed_paste();
 inline void ed_delete_char_row(int pos);
 
+/* undo */
+void ed_undo_seal();
+void ed_undo_log(int op, int row, int pos, const char *s, int len);
+int ed_undo_keep_rows(int rpos, TextRow *rows, int n);
+void ed_undo();
+void ed_redo();
+void ed_undo_own(const char *s);
+void ed_undo_clear();
+
+/* search */
+const char *ed_find(const char *h, size_t hlen, const char *n, size_t nlen);
+void ed_search(int dir);
+void ed_search_next(int dir);
+void ed_incsearch_poll();
+void ed_command();
+
+/* registers */
+void ed_store_unref(int id);
+void ed_reg_own(const char *s);
+void ed_reg_clear();
+
+/* operators */
+void ed_operator(int op, int count);
+void ed_put(int after, int count);
+
 /* mode */
 inline void to_normal_mode();
 inline void to_insert_mode();
 
 /* file I/O */
 void ed_open(const char *filename);
-char *ed_rows2str(int *buflen);
+void ed_close_file();
+void ed_quit();
+void ed_show_fileinfo();
+int ed_load_publish();
+void ed_load_rows(int n);
 void ed_save();
+void ed_save_poll();
+void ed_save_wait();
+
+/* journal */
+void ed_journal(int op, int row, int pos, const char *s, int len);
+void ed_journal_flush();
+void ed_journal_sync();
+void ed_journal_mark();
+void ed_journal_saved();
+void ed_journal_open();
+void ed_journal_close();
 
 /* init */
 inline void init_editor();